@@ -0,0 +1,61 @@
+// one node of the flattened mondrian tree, matches mondrian::flat_bvh_node
+// byte for byte (64 bytes, std430) so the CPU built tree uploads as is.
+// a child with count == 0 is the index of another node, otherwise it is
+// the range [child, child + count) into the morton sorted primitive ids
+struct FlatBvhNode {
+    l_min: vec3<f32>,
+    l_child: u32,
+    l_max: vec3<f32>,
+    l_count: u32,
+    r_min: vec3<f32>,
+    r_child: u32,
+    r_max: vec3<f32>,
+    r_count: u32,
+}
+
+@group(0) @binding(0) var<storage, read> bvh: array<FlatBvhNode>;
+@group(0) @binding(1) var<storage, read> prim_ids: array<u32>;
+// set to 1 when a traversal ran out of stack and dropped a subtree, its count is
+// then too low. the host clears it before the dispatch and reads it back after,
+// mondrian::fits_wgsl_stack tells up front whether a tree can overflow at all
+@group(0) @binding(2) var<storage, read_write> stack_overflow: atomic<u32>;
+
+const STACK_SIZE = 64u;
+
+fn overlaps(a_min: vec3<f32>, a_max: vec3<f32>, b_min: vec3<f32>, b_max: vec3<f32>) -> bool {
+    return all(a_min <= b_max) && all(b_min <= a_max);
+}
+
+// number of primitive boxes overlapping the query box, the left child sits right
+// after its parent so it is pushed last and read next
+fn count_overlaps(q_min: vec3<f32>, q_max: vec3<f32>) -> u32 {
+    var stack: array<u32, STACK_SIZE>;
+    var sp = 1u;
+    stack[0] = 0u;
+    var hits = 0u;
+    while (sp > 0u) {
+        sp -= 1u;
+        let node = bvh[stack[sp]];
+        if (overlaps(node.r_min, node.r_max, q_min, q_max)) {
+            if (node.r_count > 0u) {
+                hits += node.r_count;
+            } else if (sp < STACK_SIZE) {
+                stack[sp] = node.r_child;
+                sp += 1u;
+            } else {
+                atomicStore(&stack_overflow, 1u);
+            }
+        }
+        if (overlaps(node.l_min, node.l_max, q_min, q_max)) {
+            if (node.l_count > 0u) {
+                hits += node.l_count;
+            } else if (sp < STACK_SIZE) {
+                stack[sp] = node.l_child;
+                sp += 1u;
+            } else {
+                atomicStore(&stack_overflow, 1u);
+            }
+        }
+    }
+    return hits;
+}
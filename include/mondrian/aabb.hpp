@@ -4,14 +4,26 @@
 
 #include <iostream>
 #include <array>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <cassert>
 #include <stack>
 #include <memory>
 #include <random>
+#include <span>
+#include <concepts>
+
+#if defined(__AVX2__) || defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 #include "glm_typedefs.h"
+#include "parallel.hpp"
+#include "radix_sort.hpp"
 
 using uint = unsigned int;
 using uint2 = std::array<uint, 2>;
@@ -45,6 +57,12 @@ namespace mondrian
       return true;
     }
 
+    // true when B lies entirely inside A
+    bool contains(const extents_t &A, const extents_t &B)
+    {
+      return !less_than(B[0], A[0]) && !greater_than(B[1], A[1]);
+    }
+
     extents_t inflate(extents_t e, real eps)
     {
       vec3 deps(eps, eps, eps);
@@ -69,6 +87,8 @@ namespace mondrian
       return eout;
     }
 
+    // distance from x to the center of the box, not a bound on anything inside it,
+    // queries prune with distance2
     real distance(const extents_t &e, const vec3 &x)
     {
       extents_t eout;
@@ -76,6 +96,20 @@ namespace mondrian
       c *= 0.5;
       return norm(x - c);
     }
+
+    // squared distance from x to the closest point of the box, 0 inside
+    real distance2(const extents_t &e, const vec3 &x)
+    {
+      vec3 d = max(max(e[0] - x, x - e[1]), vec3(0.0));
+      return glm::dot(d, d);
+    }
+
+    // surface area, the SAH cost of a box
+    real area(const extents_t &e)
+    {
+      vec3 d = max(e[1] - e[0], vec3(0.0));
+      return 2.0f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
   } // namespace ext
 
   // want to be able to use reals or doubles
@@ -127,22 +161,83 @@ namespace mondrian
     return xx * 4 + yy * 2 + zz;
   }
 
-  inline int clz(uint i, uint j, const std::vector<int> &ids, const std::vector<int> &hash)
+  // Expands a 21-bit integer into 63 bits
+  // by inserting 2 zeros after each bit.
+  inline uint64_t expandBits64(uint64_t v)
+  {
+    v &= 0x00000000001FFFFFull;
+    v = (v | v << 32) & 0x001F00000000FFFFull;
+    v = (v | v << 16) & 0x001F0000FF0000FFull;
+    v = (v | v << 8) & 0x100F00F00F00F00Full;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+  }
+
+  // Calculates a 63-bit Morton code for the
+  // given 3D point located within the unit cube [0,1].
+  inline uint64_t packVec3_64(real x, real y, real z)
+  {
+    // 2^21 cells per axis, float still holds 2^21 - 1 exactly
+    x = scale(x, 2097152.0f);
+    y = scale(y, 2097152.0f);
+    z = scale(z, 2097152.0f);
+    uint64_t xx = expandBits64((uint64_t)x);
+    uint64_t yy = expandBits64((uint64_t)y);
+    uint64_t zz = expandBits64((uint64_t)z);
+    return xx * 4 + yy * 2 + zz;
+  }
+
+  // key width of the morton codes, int is the original 30 bit path,
+  // uint64_t the 63 bit path for scenes where 1024 cells per axis collide
+  template <typename K>
+  struct morton_key;
+
+  template <>
+  struct morton_key<int>
+  {
+    static const int bits_per_axis = 10;
+    static int pack(real x, real y, real z) { return packVec3(x, y, z); }
+  };
+
+  template <>
+  struct morton_key<uint64_t>
+  {
+    static const int bits_per_axis = 21;
+    static uint64_t pack(real x, real y, real z) { return packVec3_64(x, y, z); }
+  };
+
+  template <typename K>
+  inline int clz_key(K k)
+  {
+    if constexpr (sizeof(K) == 8)
+      return __builtin_clzll(uint64_t(k));
+    else
+      return __builtin_clz(uint(k));
+  }
+
+  template <typename K>
+  inline int clz(uint i, uint j, const std::vector<int> &ids, const std::vector<K> &hash)
   {
 
     if (j < 0)
       return -1;
     if (j > ids.size() - 1)
       return -1;
-    int code_i = hash[ids[i]];
-    int code_j = hash[ids[j]];
+    K code_i = hash[ids[i]];
+    K code_j = hash[ids[j]];
+    // duplicate codes fall back to comparing positions, otherwise
+    // clz(0) is undefined and the range search breaks down
+    if (code_i == code_j)
+      return 8 * sizeof(K) + (i == j ? 32 : __builtin_clz(i ^ j));
     // std::cout << "     " << code_i << " " << dump_binary(code_i) << std::endl;
     // std::cout << "     " << code_j << " "<< dump_binary(code_j) << std::endl;
     // std::cout << "     " << __builtin_clz(code_i ^ code_j) << std::endl;
-    return __builtin_clz(code_i ^ code_j);
+    return clz_key(code_i ^ code_j);
   }
 
-  uint find_split(int start, int end, const std::vector<int> &ids, const std::vector<int> &hash)
+  template <typename K>
+  uint find_split(int start, int end, const std::vector<int> &ids, const std::vector<K> &hash)
   {
 
     // uint first_code = hash[ids[start]];
@@ -176,7 +271,8 @@ namespace mondrian
     return split;
   }
 
-  uint2 find_range(const int &i, const std::vector<int> &ids, const std::vector<int> &hash)
+  template <typename K>
+  uint2 find_range(const int &i, const std::vector<int> &ids, const std::vector<K> &hash)
   {
     uint N = ids.size();
 
@@ -209,6 +305,22 @@ namespace mondrian
     uint parent = UNULL;
   };
 
+  // nodes holds N - 1 internal nodes followed by N leaves
+  inline uint get_leaf_start(std::span<const radix_tree_node> nodes) { return nodes.size() / 2; }
+
+  inline bool is_leaf(uint i, uint leaf_start) { return i >= leaf_start; }
+
+  // children in the karras layout, a child covering a single key is a leaf
+  inline uint left_child(const radix_tree_node &n, uint leaf_start)
+  {
+    return n.split == n.start ? leaf_start + n.split : n.split;
+  }
+
+  inline uint right_child(const radix_tree_node &n, uint leaf_start)
+  {
+    return n.split + 1 == n.end ? leaf_start + n.split + 1 : n.split + 1;
+  }
+
   void dump_nodes(const std::vector<radix_tree_node> &nodes)
   {
     int i = 0;
@@ -218,7 +330,8 @@ namespace mondrian
     }
   }
 
-  std::vector<radix_tree_node> build_tree(const std::vector<int> &ids, const std::vector<int> &hash)
+  template <typename K>
+  std::vector<radix_tree_node> build_tree(const std::vector<int> &ids, const std::vector<K> &hash)
   {
     std::vector<radix_tree_node> nodes(ids.size() + ids.size() - 1);
     uint leaf_start = ids.size() - 1;
@@ -230,8 +343,11 @@ namespace mondrian
       nodes[leaf_start + i].parent = UNULL;
     }
 
-    for (int i = 0; i < ids.size() - 1; i++)
-    {
+    // every internal node only reads the sorted codes, so they are built independently.
+    // each node is the parent of exactly two children, so the parent links are
+    // written once each and never race with one another
+    parallel_for(0, int(ids.size()) - 1, [&](int i)
+                 {
       uint2 range = find_range(i, ids, hash);
       uint split = find_split(range[0], range[1], ids, hash);
 
@@ -246,15 +362,117 @@ namespace mondrian
       if (split + 1 == range[1])
         nodes[leaf_start + range[1]].parent = i;
       else
-        nodes[split + 1].parent = i;
-    }
+        nodes[split + 1].parent = i; });
 #if 0 // dump nodes
   dump_nodes(nodes);
 #endif
     return nodes;
   }
 
-  void test_tree(const std::vector<radix_tree_node> &nodes, const std::vector<int> &ids, const std::vector<int> &hash)
+  // max depth and mean leaf depth of the tree, the mean leaf depth is roughly
+  // the number of nodes a query has to touch to reach a primitive
+  std::array<real, 2> tree_depth(const std::vector<radix_tree_node> &nodes)
+  {
+    uint leaf_start = get_leaf_start(nodes);
+    if (leaf_start == 0)
+      return {0.0, 0.0};
+
+    int max_depth = 0;
+    double sum_depth = 0.0;
+    std::stack<std::array<uint, 2>> stack;
+    stack.push({0, 0});
+    while (stack.size() > 0)
+    {
+      auto [i, d] = stack.top();
+      stack.pop();
+      if (is_leaf(i, leaf_start))
+      {
+        max_depth = std::max(max_depth, int(d));
+        sum_depth += d;
+        continue;
+      }
+      stack.push({left_child(nodes[i], leaf_start), d + 1});
+      stack.push({right_child(nodes[i], leaf_start), d + 1});
+    }
+    return {real(max_depth), real(sum_depth / (leaf_start + 1))};
+  }
+
+  // lays an explicit binary tree out in the karras order, so builders that don't come
+  // straight out of the morton order still produce the same radix_tree_node format.
+  // children holds both children of every internal node [0, leaf_start), a child
+  // >= leaf_start is the leaf standing for primitive ids[child - leaf_start].
+  // writes the primitives in their new leaf order to ids_out, and for every new
+  // node the index it had in the input to remap so per node data can follow along
+  std::vector<radix_tree_node> layout_tree(uint root, const std::vector<uint2> &children,
+                                           const std::vector<int> &ids,
+                                           std::vector<int> &ids_out, std::vector<uint> &remap)
+  {
+    uint leaf_start = ids.size() - 1;
+    std::vector<radix_tree_node> nodes(ids.size() + ids.size() - 1);
+    ids_out.resize(ids.size());
+    remap.resize(nodes.size());
+
+    // leaf counts, a post order walk
+    std::vector<uint> count(leaf_start, 0);
+    std::vector<std::array<uint, 2>> stack = {{root, 0}};
+    while (stack.size() > 0)
+    {
+      auto [i, expanded] = stack.back();
+      stack.pop_back();
+      if (is_leaf(i, leaf_start))
+        continue;
+      if (expanded)
+      {
+        for (uint c : children[i])
+          count[i] += is_leaf(c, leaf_start) ? 1 : count[c];
+        continue;
+      }
+      stack.push_back({i, 1});
+      stack.push_back({children[i][0], 0});
+      stack.push_back({children[i][1], 0});
+    }
+
+    // pre order, every node knows the first leaf it covers and its new index
+    struct item
+    {
+      uint old_i, new_i, start, parent;
+    };
+    std::vector<item> items = {{root, 0, 0, UNULL}};
+    while (items.size() > 0)
+    {
+      item it = items.back();
+      items.pop_back();
+      remap[it.new_i] = it.old_i;
+      nodes[it.new_i].parent = it.parent;
+      if (is_leaf(it.old_i, leaf_start))
+      {
+        ids_out[it.start] = ids[it.old_i - leaf_start];
+        nodes[it.new_i].start = it.new_i;
+        nodes[it.new_i].end = it.new_i + 1;
+        continue;
+      }
+
+      uint l = children[it.old_i][0];
+      uint r = children[it.old_i][1];
+      uint n_left = is_leaf(l, leaf_start) ? 1 : count[l];
+      uint n_right = is_leaf(r, leaf_start) ? 1 : count[r];
+      uint split = it.start + n_left - 1;
+      nodes[it.new_i].start = it.start;
+      nodes[it.new_i].end = it.start + n_left + n_right - 1;
+      nodes[it.new_i].split = split;
+
+      // a left child ends at the split and a right child starts right after it,
+      // which is exactly how build_tree indexes them
+      uint new_l = n_left == 1 ? leaf_start + split : split;
+      uint new_r = n_right == 1 ? leaf_start + split + 1 : split + 1;
+      items.push_back({l, new_l, it.start, it.new_i});
+      items.push_back({r, new_r, split + 1, it.new_i});
+    }
+    return nodes;
+  }
+
+  void test_tree(const std::vector<radix_tree_node> &nodes, const std::vector<int> &ids, const std::vector<int> &hash,
+                 bool verbose = false)
   {
     std::vector<bool> visited(ids.size(), false);
     std::stack<uint> stack;
@@ -265,14 +483,17 @@ namespace mondrian
     {
       uint i = stack.top();
       stack.pop();
-      std::cout << "i: " << i << std::endl;
-      // cout current node
-      std::cout << "node["
-                << i << "]: "
-                << nodes[i].start << " "
-                << nodes[i].end << " "
-                << nodes[i].split << " "
-                << nodes[i].parent << " " << std::endl;
+      if (verbose)
+      {
+        std::cout << "i: " << i << std::endl;
+        // cout current node
+        std::cout << "node["
+                  << i << "]: "
+                  << nodes[i].start << " "
+                  << nodes[i].end << " "
+                  << nodes[i].split << " "
+                  << nodes[i].parent << " " << std::endl;
+      }
 
       if (nodes[i].split + 0 == nodes[i].start ||
           nodes[i].split + 1 == nodes[i].end)
@@ -315,14 +536,14 @@ namespace mondrian
     }
   }
 
-  void unit_test_tree()
+  void unit_test_tree(bool verbose = false)
   {
     std::vector<int> hash = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
     // std::vector<int> hash = {0, 1, 2, 3, 4, 5, 6, 7};
 
     std::vector<int> ids = hash;
     std::vector<radix_tree_node> nodes = build_tree(ids, hash);
-    test_tree(nodes, ids, hash);
+    test_tree(nodes, ids, hash, verbose);
   }
 
   using extents_3 = std::array<vec3, 2>;
@@ -386,6 +607,60 @@ namespace mondrian
     return pyramid;
   }
 
+  // bottom up reduction over a fixed topology, every leaf walks toward the root and
+  // the second child to reach a node computes op(left, right) for it, the first one stops.
+  // each node is touched exactly once, so it is O(N), has no depth limit and can run in
+  // parallel. unlike the insertion above, non idempotent ops (sums, moments) are exact.
+  // pyramid must already be sized to nodes, so refitting a tree reuses its storage
+  template <typename T>
+  void refit_pyramid(std::vector<T> &pyramid, const std::vector<T> &data, const std::vector<radix_tree_node> &nodes,
+                     const std::function<T(const T &, const T &)> &op)
+  {
+    uint leaf_start = data.size() - 1;
+    std::vector<std::atomic<int>> visits(leaf_start);
+    for (auto &v : visits)
+      v.store(0, std::memory_order_relaxed);
+
+    parallel_for(0, int(data.size()), [&](int i)
+                 {
+      uint ii = leaf_start + i;
+      pyramid[ii] = data[i];
+
+      uint parent = nodes[ii].parent;
+      while (parent != UNULL)
+      {
+        // acq_rel so the second visitor sees the sibling subtree written by the first
+        if (visits[parent].fetch_add(1, std::memory_order_acq_rel) == 0)
+          break;
+        const radix_tree_node &n = nodes[parent];
+        pyramid[parent] = op(pyramid[left_child(n, leaf_start)], pyramid[right_child(n, leaf_start)]);
+        parent = n.parent;
+      } });
+  }
+
+  template <typename T>
+  std::vector<T> build_pyramid_bottom_up(const std::vector<T> &data, const std::vector<radix_tree_node> &nodes,
+                                         const std::function<T()> &init,
+                                         const std::function<T(const T &, const T &)> &op)
+  {
+    std::vector<T> pyramid(nodes.size(), init());
+    refit_pyramid(pyramid, data, nodes, op);
+    return pyramid;
+  }
+
+  // surface area heuristic cost of the tree normalized by the root area,
+  // lower is better. leaves hold a single primitive
+  real sah_cost(const std::vector<radix_tree_node> &nodes, const std::vector<extents_3> &extents,
+                real c_inner = 1.2, real c_leaf = 1.0)
+  {
+    uint leaf_start = get_leaf_start(nodes);
+    double cost = 0.0;
+    for (uint i = 0; i < nodes.size(); i++)
+      cost += (is_leaf(i, leaf_start) ? c_leaf : c_inner) * ext::area(extents[i]);
+    real root_area = ext::area(extents[0]);
+    return root_area > 0.0 ? real(cost / root_area) : 0.0;
+  }
+
   void dump_cube_list()
   {
     for (int i = 0; i < 8; i++)
@@ -514,8 +789,8 @@ namespace mondrian
   std::vector<vec3> get_cens(const test_case &test_case)
   {
     int stride = test_case.stride();
-    const std::vector<vec3> x = test_case.x();
-    const std::vector<int> indices = test_case.indices();
+    const std::vector<vec3> &x = test_case.x();
+    const std::vector<int> &indices = test_case.indices();
     int N = indices.size() / stride;
     std::vector<vec3> cens(N);
     for (int i = 0; i < N; i++)
@@ -531,88 +806,382 @@ namespace mondrian
     return cens;
   }
 
-  class aabb_build
+  // morton code of every centroid, quantized against the bounding box of the centroids
+  template <typename K = int>
+  std::vector<K> calc_morton_codes(const std::vector<vec3> &cens)
   {
-  public:
-    typedef std::shared_ptr<aabb_build> ptr;
+    // calc bounding box of cens
+    vec3 mn = cens[0];
+    vec3 mx = cens[0];
+    for (int i = 0; i < cens.size(); i++)
+    {
+      mn = min(mn, cens[i]);
+      mx = max(mx, cens[i]);
+    }
 
-    static ptr create() { return std::make_shared<aabb_build>(); }
+    std::vector<K> hash(cens.size(), 0);
+    for (int i = 0; i < cens.size(); i++)
+    {
+      vec3 c = cens[i] - mn;
+      vec3 n = mx - mn;
+      c = div(c, n);
+      hash[i] = morton_key<K>::pack(c[0], c[1], c[2]);
+    }
+    return hash;
+  }
 
-    aabb_build() { load_shell(); };
+  // primitive centroids as three float streams
+  struct centroids
+  {
+    std::vector<real> x, y, z;
 
-    void load_shell()
+    int size() const { return x.size(); }
+  };
+
+  // what the builders need of a set of primitives: how many there are, the box and
+  // the centroid of primitive i. scalar is the precision the geometry is kept in, the
+  // tree itself stays in real and holds boxes rounded outwards to it
+  template <typename P>
+  concept primitive_set = requires(const P &prims, int i) {
+    typename P::scalar;
+    typename P::vec;
+    { prims.size() } -> std::convertible_to<int>;
+    { prims.bounds(i) } -> std::same_as<extents_3>;
+    { prims.centroid(i) } -> std::same_as<vec3>;
+  };
+
+  namespace detail
+  {
+    // nearest real below / above x, so a box converted down from double still
+    // contains everything it did before. no-ops when T is real already
+    template <typename T>
+    inline real round_down(T x)
     {
-      _test_case = test_case::create(100, 3);
-      //__M = load_cube();
+      real f = real(x);
+      return T(f) > x ? std::nextafter(f, -ext::inf_t) : f;
     }
 
-    void step_dynamics(int frame)
+    template <typename T>
+    inline real round_up(T x)
     {
-      unit_test_tree();
-      test_case & M = *_test_case;
+      real f = real(x);
+      return T(f) < x ? std::nextafter(f, ext::inf_t) : f;
+    }
+  } // namespace detail
+
+  // N vertices per primitive, gathered from the shared vertex array through indices.
+  // a view, the arrays stay with the caller and have to outlive the set. the stride
+  // is a compile time constant so bounds and centroid unroll
+  template <typename T, int N>
+  struct simplex_set
+  {
+    using scalar = T;
+    using vec = glm::vec<3, T>;
+    static constexpr int stride = N;
 
-      std::vector<vec3> &x = M.x();
-      std::vector<vec3> cens = get_cens(M);
-      std::vector<int> m_indices = M.indices();
+    std::span<const int> indices;
+    std::span<const vec> x;
 
-      // calc bounding box of cens
-      vec3 mn = cens[0];
-      vec3 mx = cens[0];
-      for (int i = 0; i < cens.size(); i++)
+    simplex_set() = default;
+    simplex_set(std::span<const int> indices, std::span<const vec> x) : indices(indices), x(x) {}
+
+    int size() const { return indices.size() / N; }
+    const vec &vertex(int i, int k) const { return x[indices[N * i + k]]; }
+
+    extents_3 bounds(int i) const
+    {
+      vec lo = vertex(i, 0), hi = lo;
+      for (int k = 1; k < N; k++)
       {
-        mn = min(mn, cens[i]);
-        mx = max(mx, cens[i]);
+        lo = glm::min(lo, vertex(i, k));
+        hi = glm::max(hi, vertex(i, k));
       }
+      return {vec3(detail::round_down(lo[0]), detail::round_down(lo[1]), detail::round_down(lo[2])),
+              vec3(detail::round_up(hi[0]), detail::round_up(hi[1]), detail::round_up(hi[2]))};
+    }
+
+    vec3 centroid(int i) const
+    {
+      vec c = vertex(i, 0);
+      for (int k = 1; k < N; k++)
+        c += vertex(i, k);
+      return vec3(c / T(N));
+    }
+  };
 
-      std::vector<int> hash(cens.size(), 0);
-      std::vector<int> indices(cens.size(), 0);
-      for (int i = 0; i < cens.size(); i++)
+  // centroids of the primitives and their bounding box in one parallel pass, every
+  // chunk reduces its own box and the boxes are merged after
+  template <primitive_set P>
+  ext::extents_t calc_centroids(const P &prims, centroids &cens)
+  {
+    int N = prims.size();
+    cens.x.resize(N);
+    cens.y.resize(N);
+    cens.z.resize(N);
+    int n_chunks = num_chunks(N);
+    std::vector<ext::extents_t> boxes(n_chunks, ext::init());
+    parallel_for_chunks(0, N, n_chunks, [&](int t, int b, int e)
+                        {
+      // per axis scalars so the min / max stay in registers
+      real lo[3] = {ext::inf_t, ext::inf_t, ext::inf_t};
+      real hi[3] = {-ext::inf_t, -ext::inf_t, -ext::inf_t};
+      for (int i = b; i < e; i++)
       {
-        indices[i] = i;
-        vec3 c = cens[i] - mn;
-        vec3 n = mx - mn;
-        c = div(c, n);
-        hash[i] = packVec3(c[0], c[1], c[2]);
+        vec3 cen = prims.centroid(i);
+        cens.x[i] = cen[0];
+        cens.y[i] = cen[1];
+        cens.z[i] = cen[2];
+        for (int k = 0; k < 3; k++)
+        {
+          lo[k] = std::min(lo[k], cen[k]);
+          hi[k] = std::max(hi[k], cen[k]);
+        }
       }
+      boxes[t] = {vec3(lo[0], lo[1], lo[2]), vec3(hi[0], hi[1], hi[2])}; });
+
+    ext::extents_t box = ext::init();
+    for (const ext::extents_t &b : boxes)
+      box = pyramid(box, b);
+    return box;
+  }
+
+  // calc_centroids of the primitives of STRIDE indices into x
+  template <int STRIDE>
+  ext::extents_t calc_centroids(const std::vector<int> &indices, const std::vector<vec3> &x, centroids &cens)
+  {
+    return calc_centroids(simplex_set<real, STRIDE>(indices, x), cens);
+  }
 
-      std::sort(indices.begin(), indices.end(), [&](int a, int b)
-                { return hash[a] < hash[b]; });
+  namespace detail
+  {
+    // morton code of a point already moved into the unit cube, the same cells and bit
+    // order as morton_key<K>::pack. BMI2 deposits the bits in one instruction per axis
+    template <typename K>
+    inline K morton_code(real x, real y, real z)
+    {
+#if defined(__BMI2__)
+      if constexpr (std::is_same_v<K, int>)
+        return _pdep_u32(scale(x, 1024.0f), 0x24924924u) | _pdep_u32(scale(y, 1024.0f), 0x12492492u) |
+               _pdep_u32(scale(z, 1024.0f), 0x09249249u);
+      else
+        return _pdep_u64(scale(x, 2097152.0f), 0x4924924924924924ull) |
+               _pdep_u64(scale(y, 2097152.0f), 0x2492492492492492ull) |
+               _pdep_u64(scale(z, 2097152.0f), 0x1249249249249249ull);
+#else
+      return morton_key<K>::pack(x, y, z);
+#endif
+    }
 
-      std::vector<radix_tree_node> nodes = build_tree(indices, hash);
-      int r0 = nodes[nodes[nodes[0].split].split].start;
-      int r1 = nodes[nodes[nodes[0].split].split].end;
-      int leaf_start = indices.size() - 1;
+#if defined(__AVX2__)
+    // expandBits on 8 lanes, the multiplies only keep their low 32 bits like the scalar one
+    inline __m256i expand_bits8(__m256i v)
+    {
+      v = _mm256_and_si256(_mm256_mullo_epi32(v, _mm256_set1_epi32(0x00010001)), _mm256_set1_epi32(0xFF0000FF));
+      v = _mm256_and_si256(_mm256_mullo_epi32(v, _mm256_set1_epi32(0x00000101)), _mm256_set1_epi32(0x0F00F00F));
+      v = _mm256_and_si256(_mm256_mullo_epi32(v, _mm256_set1_epi32(0x00000011)), _mm256_set1_epi32(0xC30C30C3));
+      v = _mm256_and_si256(_mm256_mullo_epi32(v, _mm256_set1_epi32(0x00000005)), _mm256_set1_epi32(0x49249249));
+      return v;
+    }
+
+    // scale((c - mn) / extent, 1024) on 8 lanes
+    inline __m256i morton_cell8(const real *c, __m256 mn, __m256 extent)
+    {
+      __m256 u = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(c), mn), extent);
+      u = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(u, _mm256_set1_ps(1024.0f)), _mm256_setzero_ps()),
+                        _mm256_set1_ps(1023.0f));
+      return _mm256_cvttps_epi32(u);
+    }
+#endif
+  } // namespace detail
 
-      std::vector<extents_3> extents(m_indices.size() / 3);
-      for (int i = 0; i < m_indices.size() / 3; i++)
+  // morton codes of the centroid streams quantized against bounds, in parallel. the
+  // codes are the same as calc_morton_codes on the same centroids, an axis the
+  // centroids don't spread along just quantizes to 0. 30 bit codes run 8 wide on AVX2
+  template <typename K = int>
+  std::vector<K> calc_morton_codes(const centroids &cens, const ext::extents_t &bounds)
+  {
+    int N = cens.size();
+    std::vector<K> hash(N);
+    vec3 mn = bounds[0];
+    vec3 n = bounds[1] - bounds[0];
+    for (int k = 0; k < 3; k++)
+      n[k] = n[k] > 0.0f ? n[k] : 1.0f;
+
+    parallel_for_chunks(0, N, [&](int, int b, int e)
+                        {
+      int i = b;
+#if defined(__AVX2__)
+      if constexpr (std::is_same_v<K, int>)
       {
-        extents[i] = calc_extents<3>(indices[i], m_indices, x);
-        // log_extents(extents[i]);
+        const __m256 mnx = _mm256_set1_ps(mn[0]), mny = _mm256_set1_ps(mn[1]), mnz = _mm256_set1_ps(mn[2]);
+        const __m256 nx = _mm256_set1_ps(n[0]), ny = _mm256_set1_ps(n[1]), nz = _mm256_set1_ps(n[2]);
+        for (; i + 8 <= e; i += 8)
+        {
+          __m256i xx = detail::expand_bits8(detail::morton_cell8(&cens.x[i], mnx, nx));
+          __m256i yy = detail::expand_bits8(detail::morton_cell8(&cens.y[i], mny, ny));
+          __m256i zz = detail::expand_bits8(detail::morton_cell8(&cens.z[i], mnz, nz));
+          __m256i key = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(xx, 2), _mm256_slli_epi32(yy, 1)), zz);
+          _mm256_storeu_si256((__m256i *)&hash[i], key);
+        }
       }
+#endif
+      for (; i < e; i++)
+        hash[i] = detail::morton_code<K>((cens.x[i] - mn[0]) / n[0], (cens.y[i] - mn[1]) / n[1],
+                                         (cens.z[i] - mn[2]) / n[2]); });
+    return hash;
+  }
+
+  // primitive ids ordered by their morton code, ties keep their input order
+  template <typename K>
+  std::vector<int> sort_by_code(const std::vector<K> &hash)
+  {
+    std::vector<int> indices(hash.size(), 0);
+    for (int i = 0; i < hash.size(); i++)
+      indices[i] = i;
+
+    std::vector<K> keys = hash;
+    radix_sort_pairs(keys, indices);
+    return indices;
+  }
 
-      std::vector<extents_3> ext = build_pyramid<extents_3>(
-          extents, leaf_start, nodes,
-          []()
-          { return ext::init(); },
-          [](const extents_3 &a, const extents_3 &b)
-          { return pyramid(a, b); });
+  // a built tree: the topology, its extents pyramid and the primitive behind every leaf,
+  // leaf node leaf_start() + j holds primitive ids[j]
+  struct aabb_tree
+  {
+    std::vector<radix_tree_node> nodes;
+    std::vector<extents_3> extents;
+    std::vector<int> ids;
 
-      int test_id = leaf_start + 1;
-      // log_extents_to_parent(1000, leaf_start, nodes, ext);
-      // log_extents_to_parent(1, leaf_start, nodes, ext);
-      // log_extents_to_parent(2, leaf_start, nodes, ext);
+    uint leaf_start() const { return get_leaf_start(nodes); }
+    int size() const { return ids.size(); }
+  };
 
-      /*
-      for (int i = 0; i < (indices.size() - 1); i++)
+  // non owning view of a built tree, what the queries take so they run the same on a
+  // tree in memory and on one mapped from a file
+  struct aabb_tree_view
+  {
+    aabb_tree_view() = default;
+    aabb_tree_view(const aabb_tree &tree) : nodes(tree.nodes), extents(tree.extents), ids(tree.ids) {}
+    aabb_tree_view(std::span<const radix_tree_node> nodes, std::span<const extents_3> extents, std::span<const int> ids)
+        : nodes(nodes), extents(extents), ids(ids) {}
+
+    std::span<const radix_tree_node> nodes;
+    std::span<const extents_3> extents;
+    std::span<const int> ids;
+
+    uint leaf_start() const { return get_leaf_start(nodes); }
+    int size() const { return ids.size(); }
+  };
+
+  // morton sorts the primitives, builds the tree and its extents
+  template <primitive_set P, typename K = int>
+  aabb_tree build_aabb_tree(const P &prims)
+  {
+    int N = prims.size();
+    if (N == 0)
+      return aabb_tree();
+    centroids cens;
+    ext::extents_t bounds = calc_centroids(prims, cens);
+
+    aabb_tree tree;
+    std::vector<K> hash = calc_morton_codes<K>(cens, bounds);
+    tree.ids = sort_by_code(hash);
+    tree.nodes = build_tree(tree.ids, hash);
+
+    std::vector<extents_3> leaves(N);
+    parallel_for(0, N, [&](int i)
+                 { leaves[i] = prims.bounds(tree.ids[i]); });
+    tree.extents = build_pyramid_bottom_up<extents_3>(
+        leaves, tree.nodes,
+        []()
+        { return ext::init(); },
+        [](const extents_3 &a, const extents_3 &b)
+        { return pyramid(a, b); });
+    return tree;
+  }
+
+  // build_aabb_tree over primitives of STRIDE indices into x
+  template <int STRIDE, typename K = int>
+  aabb_tree build_aabb_tree(const std::vector<int> &indices, const std::vector<vec3> &x)
+  {
+    return build_aabb_tree<simplex_set<real, STRIDE>, K>(simplex_set<real, STRIDE>(indices, x));
+  }
+
+  // recomputes the leaf boxes from moved primitives and refits the pyramid on the
+  // existing topology, the connectivity must be the one the tree was built from
+  template <primitive_set P>
+  void refit_aabb_tree(aabb_tree &tree, const P &prims)
+  {
+    int N = tree.size();
+    if (N == 0)
+      return;
+    std::vector<extents_3> leaves(N);
+    parallel_for(0, N, [&](int i)
+                 { leaves[i] = prims.bounds(tree.ids[i]); });
+    refit_pyramid<extents_3>(tree.extents, leaves, tree.nodes,
+                             [](const extents_3 &a, const extents_3 &b)
+                             { return pyramid(a, b); });
+  }
+
+  // refit_aabb_tree from moved vertices, indices must be the ones the tree was built from
+  template <int STRIDE>
+  void refit_aabb_tree(aabb_tree &tree, const std::vector<int> &indices, const std::vector<vec3> &x)
+  {
+    refit_aabb_tree(tree, simplex_set<real, STRIDE>(indices, x));
+  }
+
+  class aabb_build
+  {
+  public:
+    typedef std::shared_ptr<aabb_build> ptr;
+
+    static ptr create() { return std::make_shared<aabb_build>(); }
+
+    aabb_build() { load_shell(); };
+
+    void load_shell()
+    {
+      _test_case = test_case::create(100, 3);
+      //__M = load_cube();
+    }
+
+    // full build, centroids, morton codes, sort, topology and pyramid
+    void rebuild()
+    {
+      test_case &M = *_test_case;
+      _tree = build_aabb_tree<3>(M.indices(), M.x());
+      _build_cost = sah_cost(_tree.nodes, _tree.extents);
+      _cost = _build_cost;
+      _n_refits = 0;
+    }
+
+    // refits the bounds of the current topology to the moved vertices. refitting lets boxes
+    // grow and overlap, so once the SAH cost passes rebuild_threshold times the cost right
+    // after the last build the tree is rebuilt instead. returns false when it rebuilt
+    bool refit()
+    {
+      test_case &M = *_test_case;
+      if (_tree.size() == 0 || _tree.size() != M.indices().size() / M.stride())
+      {
+        rebuild();
+        return false;
+      }
+
+      refit_aabb_tree<3>(_tree, M.indices(), M.x());
+      _cost = sah_cost(_tree.nodes, _tree.extents);
+      _n_refits++;
+      if (_cost > rebuild_threshold * _build_cost)
       {
-        vec3 xf0 = cens[indices[i + 0]];
-        vec3 xf1 = cens[indices[i + 1]];
-        if (i > r0 && i < r1)
-          logger::line(xf0, xf1, vec4(0.0, 1.0, 0.0, 1.0));
-        else
-          logger::line(xf0, xf1, vec4(1.0, 0.0, 0.0, 1.0));
+        rebuild();
+        return false;
       }
-      */
+      return true;
+    }
+
+    void step_dynamics(int frame)
+    {
+      unit_test_tree();
+      refit();
     }
 
     void step(int frame)
@@ -620,7 +1189,18 @@ namespace mondrian
       step_dynamics(frame);
     }
 
+    const aabb_tree &tree() const { return _tree; }
+    real cost() const { return _cost; }
+    int n_refits() const { return _n_refits; }
+
+    // SAH growth tolerated before a refit turns into a rebuild
+    real rebuild_threshold = 1.3;
+
     test_case::ptr _test_case;
+    aabb_tree _tree;
+    real _build_cost = 0.0;
+    real _cost = 0.0;
+    int _n_refits = 0;
   };
 
 } // mondrian
@@ -0,0 +1,193 @@
+#ifndef __MONDIAN_ASYNC_TREE__
+#define __MONDIAN_ASYNC_TREE__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // a published tree and the revision of the geometry it was built from
+  struct built_tree
+  {
+    aabb_tree tree;
+    uint64_t revision = 0;
+  };
+
+  namespace detail
+  {
+    // the lock and wakeup of the worker, shared with the deleters of the published
+    // trees. a tree whose last reader let go is queued in retired and the worker is
+    // woken to free it, once the async_tree is closed a reader frees it itself
+    struct async_state
+    {
+      std::mutex mutex;
+      std::condition_variable wake;
+      std::vector<const built_tree *> retired;
+      bool closed = false;
+    };
+  } // namespace detail
+
+  // rebuilds the tree on a worker thread so the thread that owns the geometry never
+  // waits on a build. rebuild takes a snapshot of the geometry, the worker builds from
+  // it and publishes the result with an atomic pointer swap, until then tree() keeps
+  // returning the previous one. requests that come in while a build runs are
+  // coalesced, only the latest snapshot gets built.
+  // readers hold on to the shared_ptr for as long as they query it. the last one to let
+  // go of a swapped out tree hands it back to the worker, which frees it, so query
+  // threads don't pay for the deallocation either
+  template <int STRIDE>
+  class async_tree
+  {
+  public:
+    typedef std::shared_ptr<async_tree> ptr;
+    typedef std::shared_ptr<const built_tree> tree_ptr;
+    typedef std::function<aabb_tree(const std::vector<int> &, const std::vector<vec3> &)> builder;
+
+    // the other builders plug in through a lambda, e.g. one calling build_sah_tree<STRIDE>
+    static ptr create(builder build = build_aabb_tree<STRIDE>)
+    {
+      return std::make_shared<async_tree>(std::move(build));
+    }
+
+    async_tree(builder build = build_aabb_tree<STRIDE>)
+        : _build(std::move(build)), _state(std::make_shared<detail::async_state>())
+    {
+      _tree.store(_publish(std::make_unique<const built_tree>()));
+      _worker = std::thread([this]()
+                            { _run(); });
+    }
+
+    // a build that is already running finishes first, queued ones are dropped. trees
+    // readers still hold are freed by the last of them
+    ~async_tree()
+    {
+      {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        _stop = true;
+      }
+      _state->wake.notify_all();
+      _worker.join();
+
+      std::vector<const built_tree *> retired;
+      {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        _state->closed = true;
+        retired.swap(_state->retired);
+      }
+      for (const built_tree *t : retired)
+        delete t;
+    }
+
+    // queues a build of the geometry, returns the revision it will be published under.
+    // the arguments are the snapshot, pass them with std::move to skip the copy
+    uint64_t rebuild(std::vector<int> indices, std::vector<vec3> x)
+    {
+      uint64_t revision;
+      {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        _indices.swap(indices);
+        _x.swap(x);
+        revision = ++_requested;
+      }
+      _state->wake.notify_all();
+      // a snapshot that was replaced before the worker took it goes away out here
+      return revision;
+    }
+
+    // the latest published tree, an empty one at revision 0 before the first build
+    tree_ptr tree() const { return _tree.load(std::memory_order_acquire); }
+
+    // blocks until the given revision, or by default the last requested one, or a
+    // later one that replaced it is published
+    void wait(uint64_t revision = 0)
+    {
+      std::unique_lock<std::mutex> lock(_state->mutex);
+      if (revision == 0)
+        revision = _requested;
+      _done.wait(lock, [&]()
+                 { return _published >= revision; });
+    }
+
+    bool busy() const
+    {
+      std::lock_guard<std::mutex> lock(_state->mutex);
+      return _published < _requested;
+    }
+
+  protected:
+    // the deleter runs wherever the last reference is dropped, it only queues the
+    // tree. the reference count decrement orders every reader's access before it
+    tree_ptr _publish(std::unique_ptr<const built_tree> tree)
+    {
+      return tree_ptr(tree.release(), [state = _state](const built_tree *t)
+                      {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (state->closed)
+        {
+          lock.unlock();
+          delete t;
+          return;
+        }
+        state->retired.push_back(t);
+        lock.unlock();
+        state->wake.notify_all(); });
+    }
+
+    void _run()
+    {
+      std::unique_lock<std::mutex> lock(_state->mutex);
+      while (true)
+      {
+        _state->wake.wait(lock, [&]()
+                          { return _stop || _taken < _requested || _state->retired.size() > 0; });
+        if (_state->retired.size() > 0)
+        {
+          std::vector<const built_tree *> retired;
+          retired.swap(_state->retired);
+          lock.unlock();
+          for (const built_tree *t : retired)
+            delete t;
+          lock.lock();
+          continue;
+        }
+        if (_stop)
+          break;
+        std::vector<int> indices;
+        std::vector<vec3> x;
+        indices.swap(_indices);
+        x.swap(_x);
+        uint64_t revision = _taken = _requested;
+        lock.unlock();
+
+        std::unique_ptr<built_tree> next = std::make_unique<built_tree>();
+        next->tree = _build(indices, x);
+        next->revision = revision;
+        // dropping the old tree here queues it when no reader holds it anymore
+        _tree.exchange(_publish(std::move(next)), std::memory_order_acq_rel);
+
+        lock.lock();
+        _published = revision;
+        _done.notify_all();
+      }
+    }
+
+    builder _build;
+    std::shared_ptr<detail::async_state> _state;
+    std::atomic<tree_ptr> _tree;
+
+    // the pending snapshot and the revision counters, all under _state->mutex
+    std::condition_variable _done;
+    std::vector<int> _indices;
+    std::vector<vec3> _x;
+    uint64_t _requested = 0, _taken = 0, _published = 0;
+    bool _stop = false;
+    std::thread _worker;
+  };
+
+} // mondrian
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef __MONDIAN_BARNES_HUT__
+#define __MONDIAN_BARNES_HUT__
+
+#include <cmath>
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // point masses stored as structure of arrays. strengths are the vector weights of
+  // vortex particles and stay empty for gravity, mass then weights where the centers
+  // of the tree nodes sit
+  struct particles
+  {
+    std::vector<real> x, y, z;
+    std::vector<real> mass;
+    std::vector<real> sx, sy, sz;
+
+    int size() const { return x.size(); }
+    bool has_strengths() const { return sx.size() == x.size() && x.size() > 0; }
+    vec3 position(int i) const { return vec3(x[i], y[i], z[i]); }
+    vec3 strength(int i) const { return vec3(sx[i], sy[i], sz[i]); }
+
+    void add(const vec3 &p, real m)
+    {
+      x.push_back(p[0]);
+      y.push_back(p[1]);
+      z.push_back(p[2]);
+      mass.push_back(m);
+    }
+
+    // a vortex particle, weighted by the magnitude of its strength
+    void add(const vec3 &p, const vec3 &s)
+    {
+      add(p, glm::length(s));
+      sx.push_back(s[0]);
+      sy.push_back(s[1]);
+      sz.push_back(s[2]);
+    }
+  };
+
+  // monopole of a node, the total mass and the mass weighted sum of positions.
+  // sums don't survive build_pyramid's insertion, which adds every leaf again at each
+  // level, so the moments go through the bottom up reduction
+  struct mass_moment
+  {
+    real mass = 0.0;
+    vec3 moment = vec3(0.0);
+  };
+
+  // what the traversal reads of a node, packed so accepting or opening it is one
+  // cache line. size2 is the largest box edge squared
+  struct multipole_node
+  {
+    vec3 center;
+    real mass;
+    real size2;
+  };
+
+  namespace detail
+  {
+    // softened 1 / |r|^3, the factor shared by the gravity and biot savart kernels
+    inline real inv_r3(const vec3 &r, real eps2)
+    {
+      real d2 = glm::dot(r, r) + eps2;
+      real inv = 1.0f / std::sqrt(d2);
+      return d2 > 0.0 ? inv * inv * inv : 0.0;
+    }
+
+    // acceleration at p due to a mass m at q
+    inline vec3 gravity(const vec3 &p, const vec3 &q, real m, real eps2)
+    {
+      vec3 r = q - p;
+      return m * inv_r3(r, eps2) * r;
+    }
+
+    // velocity at p induced by a vortex of strength s at q, regularized biot savart
+    inline vec3 biot_savart(const vec3 &p, const vec3 &q, const vec3 &s, real eps2)
+    {
+      vec3 r = p - q;
+      return real(0.25 / M_PI) * inv_r3(r, eps2) * glm::cross(s, r);
+    }
+  } // namespace detail
+
+  // Barnes & Hut 1986 over the aabb tree of the particles. every node carries the mass
+  // and center of mass of its subtree, a particle takes a whole node as one body when
+  // size / distance < theta and opens it otherwise, O(N log N) for any fixed theta.
+  // particles are copied in leaf order so neighbors in the traversal sit next to each
+  // other in memory and queries run in that order too
+  class barnes_hut
+  {
+  public:
+    typedef std::shared_ptr<barnes_hut> ptr;
+
+    static ptr create(const particles &p)
+    {
+      return std::make_shared<barnes_hut>(p);
+    }
+
+    barnes_hut(const particles &p)
+    {
+      build(p);
+    }
+
+    void build(const particles &p)
+    {
+      int N = p.size();
+      _tree = aabb_tree();
+      if (N == 0)
+        return;
+
+      std::vector<vec3> x(N);
+      std::vector<int> indices(N);
+      parallel_for(0, N, [&](int i)
+                   {
+        x[i] = p.position(i);
+        indices[i] = i; });
+      _tree = build_aabb_tree<1>(indices, x);
+
+      _x.resize(N), _y.resize(N), _z.resize(N), _m.resize(N);
+      std::vector<mass_moment> leaves(N);
+      parallel_for(0, N, [&](int j)
+                   {
+        int i = _tree.ids[j];
+        _x[j] = p.x[i];
+        _y[j] = p.y[i];
+        _z[j] = p.z[i];
+        _m[j] = p.mass[i];
+        leaves[j] = {p.mass[i], p.mass[i] * x[i]}; });
+
+      std::vector<mass_moment> moments = build_pyramid_bottom_up<mass_moment>(
+          leaves, _tree.nodes,
+          []()
+          { return mass_moment(); },
+          [](const mass_moment &a, const mass_moment &b)
+          { return mass_moment{a.mass + b.mass, a.moment + b.moment}; });
+
+      // centers and sizes per node, a node without mass sits at its box center
+      int n_nodes = _tree.nodes.size();
+      _multipoles.resize(n_nodes);
+      parallel_for(0, n_nodes, [&](int i)
+                   {
+        const extents_3 &e = _tree.extents[i];
+        vec3 c = moments[i].mass > 0.0 ? moments[i].moment / moments[i].mass : 0.5f * (e[0] + e[1]);
+        vec3 d = e[1] - e[0];
+        real s = std::max(std::max(d[0], d[1]), d[2]);
+        _multipoles[i] = {c, moments[i].mass, s * s}; });
+
+      _strength.clear();
+      _sx.clear(), _sy.clear(), _sz.clear();
+      if (p.has_strengths())
+      {
+        _sx.resize(N), _sy.resize(N), _sz.resize(N);
+        std::vector<vec3> s(N);
+        parallel_for(0, N, [&](int j)
+                     {
+          int i = _tree.ids[j];
+          _sx[j] = p.sx[i];
+          _sy[j] = p.sy[i];
+          _sz[j] = p.sz[i];
+          s[j] = p.strength(i); });
+        _strength = build_pyramid_bottom_up<vec3>(
+            s, _tree.nodes,
+            []()
+            { return vec3(0.0); },
+            [](const vec3 &a, const vec3 &b)
+            { return a + b; });
+      }
+    }
+
+    // walks the tree for targets inside box, calls leaves(b, e) for the particles at
+    // leaf positions [b, e) that have to be summed directly and node(i) for every node
+    // far enough from the whole box to count as one body. nodes over at most
+    // bucket_size particles aren't opened any further, their particles are contiguous
+    // so the direct sum is a plain loop over the arrays. a single target is a box with
+    // no extent
+    template <typename LEAVES, typename NODE>
+    void traverse(const extents_3 &box, real theta, std::vector<uint> &stack, LEAVES &&leaves, NODE &&node) const
+    {
+      uint leaf_start = _tree.leaf_start();
+      real theta2 = theta * theta;
+      stack.clear();
+      stack.push_back(0);
+      while (stack.size() > 0)
+      {
+        uint i = stack.back();
+        stack.pop_back();
+        if (is_leaf(i, leaf_start))
+        {
+          leaves(i - leaf_start, i - leaf_start + 1);
+          continue;
+        }
+        const multipole_node &m = _multipoles[i];
+        if (m.size2 < theta2 * ext::distance2(box, m.center))
+        {
+          node(i);
+          continue;
+        }
+        const radix_tree_node &n = _tree.nodes[i];
+        if (n.end - n.start < bucket_size)
+        {
+          leaves(n.start, n.end + 1);
+          continue;
+        }
+        stack.push_back(left_child(n, leaf_start));
+        stack.push_back(right_child(n, leaf_start));
+      }
+    }
+
+    // gravitational acceleration of every particle, in input order. eps softens close
+    // encounters and also drops the self interaction
+    std::vector<vec3> accelerations(real theta = 0.5, real eps = 1e-3, real G = 1.0) const
+    {
+      real eps2 = eps * eps;
+      std::vector<vec3> out = _evaluate(
+          theta,
+          [&](const vec3 &p, int k)
+          { return detail::gravity(p, vec3(_x[k], _y[k], _z[k]), _m[k], eps2); },
+          [&](const vec3 &p, uint i)
+          { return detail::gravity(p, _multipoles[i].center, _multipoles[i].mass, eps2); });
+      for (vec3 &a : out)
+        a *= G;
+      return out;
+    }
+
+    // velocity every vortex particle induces on the others, in input order. needs the
+    // particles to have strengths, returns zeros otherwise
+    std::vector<vec3> velocities(real theta = 0.5, real eps = 1e-3) const
+    {
+      if (_strength.empty())
+        return std::vector<vec3>(size(), vec3(0.0));
+      real eps2 = eps * eps;
+      return _evaluate(
+          theta,
+          [&](const vec3 &p, int k)
+          { return detail::biot_savart(p, vec3(_x[k], _y[k], _z[k]), vec3(_sx[k], _sy[k], _sz[k]), eps2); },
+          [&](const vec3 &p, uint i)
+          { return detail::biot_savart(p, _multipoles[i].center, _strength[i], eps2); });
+    }
+
+    // nodes over this many particles or fewer are summed directly instead of opened
+    uint bucket_size = 8;
+    // consecutive particles in leaf order that share one traversal
+    int group_size = 16;
+
+    int size() const { return _tree.size(); }
+    const aabb_tree &tree() const { return _tree; }
+    const multipole_node &multipole(uint i) const { return _multipoles[i]; }
+
+  protected:
+    // sums near(p, k) over the particles and far(p, i) over the nodes that every
+    // particle interacts with. the tree is walked once per group against the box of
+    // the group (Barnes 1990), the interaction list is then summed for each member.
+    // the box is never farther than any of its particles so no node is taken whole
+    // that a single particle would have opened
+    template <typename NEAR, typename FAR>
+    std::vector<vec3> _evaluate(real theta, NEAR &&near, FAR &&far) const
+    {
+      int N = size();
+      std::vector<vec3> out(N);
+      int group = std::max(group_size, 1);
+      int n_groups = (N + group - 1) / group;
+      parallel_for_chunks(
+          0, n_groups, [&](int, int gb, int ge)
+          {
+            std::vector<uint> stack, nodes;
+            std::vector<uint2> ranges;
+            for (int g = gb; g < ge; g++)
+            {
+              int b = g * group, e = std::min(b + group, N);
+              extents_3 box = ext::init();
+              for (int j = b; j < e; j++)
+                box = ext::expand(box, vec3(_x[j], _y[j], _z[j]));
+
+              nodes.clear();
+              ranges.clear();
+              traverse(
+                  box, theta, stack, [&](int kb, int ke)
+                  { ranges.push_back({uint(kb), uint(ke)}); },
+                  [&](uint i)
+                  { nodes.push_back(i); });
+
+              for (int j = b; j < e; j++)
+              {
+                vec3 p(_x[j], _y[j], _z[j]);
+                vec3 sum(0.0);
+                for (const uint2 &r : ranges)
+                  for (uint k = r[0]; k < r[1]; k++)
+                    sum += near(p, k);
+                for (uint i : nodes)
+                  sum += far(p, i);
+                out[_tree.ids[j]] = sum;
+              }
+            } },
+          16);
+      return out;
+    }
+
+    aabb_tree _tree;
+    // particles in leaf order
+    std::vector<real> _x, _y, _z, _m;
+    std::vector<real> _sx, _sy, _sz;
+    // per node, and the summed strength of vortex particles
+    std::vector<multipole_node> _multipoles;
+    std::vector<vec3> _strength;
+  };
+
+  // O(N^2) reference sums, what the tree is checked against
+  std::vector<vec3> direct_accelerations(const particles &p, real eps = 1e-3, real G = 1.0)
+  {
+    int N = p.size();
+    std::vector<vec3> out(N);
+    real eps2 = eps * eps;
+    parallel_for(
+        0, N, [&](int i)
+        {
+          vec3 x = p.position(i);
+          vec3 a(0.0);
+          for (int k = 0; k < N; k++)
+            a += detail::gravity(x, p.position(k), p.mass[k], eps2);
+          out[i] = G * a; },
+        64);
+    return out;
+  }
+
+  std::vector<vec3> direct_velocities(const particles &p, real eps = 1e-3)
+  {
+    int N = p.size();
+    std::vector<vec3> out(N, vec3(0.0));
+    if (!p.has_strengths())
+      return out;
+    real eps2 = eps * eps;
+    parallel_for(
+        0, N, [&](int i)
+        {
+          vec3 x = p.position(i);
+          vec3 u(0.0);
+          for (int k = 0; k < N; k++)
+            u += detail::biot_savart(x, p.position(k), p.strength(k), eps2);
+          out[i] = u; },
+        64);
+    return out;
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef __MONDIAN_BINNED_SAH__
+#define __MONDIAN_BINNED_SAH__
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // build time vs quality knobs for build_binned_sah. split candidates per axis, 16 is
+  // within a percent or two of sweeping every primitive and 32 is the most it takes.
+  // subtrees over grain primitives become their own task, smaller ones finish on the
+  // worker that split them
+  struct sah_settings
+  {
+    int bins = 16;
+    int grain = 4096;
+  };
+
+  namespace detail
+  {
+    const int max_sah_bins = 32;
+
+    // what a node reads of a primitive, kept next to each other and moved along with
+    // the partition so a node's primitives stay contiguous as the ranges shrink
+    struct sah_ref
+    {
+      extents_3 box;
+      vec3 centroid;
+      int id;
+    };
+
+    struct sah_bin
+    {
+      extents_3 box = ext::init();
+      int count = 0;
+    };
+
+    inline void grow(extents_3 &a, const extents_3 &b)
+    {
+      a[0] = glm::min(a[0], b[0]);
+      a[1] = glm::max(a[1], b[1]);
+    }
+
+    // top down builder, the primitives of a node are the range [b, e) of refs and
+    // get partitioned in place, so a subtree only ever touches its own range and
+    // subtrees split concurrently without locks. internal nodes get their index from
+    // a counter, layout_tree puts them in order afterwards
+    struct sah_builder
+    {
+      int bins, grain;
+      uint leaf_start;
+      std::vector<sah_ref> refs;
+      std::vector<uint2> children;
+      std::atomic<uint> next = 1;
+
+      sah_builder(const std::vector<extents_3> &boxes, const centroids &cens, const sah_settings &settings)
+          : bins(std::clamp(settings.bins, 2, max_sah_bins)), grain(std::max(settings.grain, 2)),
+            leaf_start(boxes.size() - 1), refs(boxes.size()), children(boxes.size() - 1)
+      {
+        parallel_for(0, int(refs.size()), [&](int i)
+                     { refs[i] = {boxes[i], vec3(cens.x[i], cens.y[i], cens.z[i]), i}; });
+      }
+
+      // bins the centroids along every axis, sweeps the bins once from each side and
+      // partitions on the cheapest boundary. returns where the right child starts.
+      // when every centroid is in the same spot there is nothing to bin and the range
+      // is cut in half
+      int split(int b, int e)
+      {
+        real lo[3] = {ext::inf_t, ext::inf_t, ext::inf_t};
+        real hi[3] = {-ext::inf_t, -ext::inf_t, -ext::inf_t};
+        for (int j = b; j < e; j++)
+          for (int k = 0; k < 3; k++)
+          {
+            lo[k] = std::min(lo[k], refs[j].centroid[k]);
+            hi[k] = std::max(hi[k], refs[j].centroid[k]);
+          }
+
+        // the largest centroid lands just inside the last bin
+        real scale[3];
+        for (int k = 0; k < 3; k++)
+          scale[k] = hi[k] > lo[k] ? real(bins) * (1.0f - 1e-6f) / (hi[k] - lo[k]) : 0.0f;
+        auto bin = [&](const sah_ref &r, int k)
+        { return std::min(int((r.centroid[k] - lo[k]) * scale[k]), bins - 1); };
+
+        sah_bin binned[3][max_sah_bins];
+        for (int j = b; j < e; j++)
+        {
+          for (int k = 0; k < 3; k++)
+          {
+            if (scale[k] == 0.0f)
+              continue;
+            sah_bin &s = binned[k][bin(refs[j], k)];
+            grow(s.box, refs[j].box);
+            s.count++;
+          }
+        }
+
+        // cost of cutting in front of bin s is A(left) N(left) + A(right) N(right), the
+        // constant part of the heuristic is the same for every candidate
+        int best_axis = -1, best_split = 0;
+        real best_cost = std::numeric_limits<real>::max();
+        for (int k = 0; k < 3; k++)
+        {
+          if (scale[k] == 0.0f)
+            continue;
+          real right_cost[max_sah_bins];
+          extents_3 box = ext::init();
+          int count = 0;
+          for (int s = bins - 1; s > 0; s--)
+          {
+            grow(box, binned[k][s].box);
+            count += binned[k][s].count;
+            right_cost[s] = count > 0 ? ext::area(box) * count : 0.0f;
+          }
+          box = ext::init();
+          count = 0;
+          for (int s = 1; s < bins; s++)
+          {
+            grow(box, binned[k][s - 1].box);
+            count += binned[k][s - 1].count;
+            if (count == 0 || count == e - b)
+              continue;
+            real cost = ext::area(box) * count + right_cost[s];
+            if (cost < best_cost)
+            {
+              best_cost = cost;
+              best_axis = k;
+              best_split = s;
+            }
+          }
+        }
+
+        if (best_axis < 0)
+          return b + (e - b) / 2;
+        sah_ref *m = std::partition(refs.data() + b, refs.data() + e, [&](const sah_ref &r)
+                                    { return bin(r, best_axis) < best_split; });
+        return m - refs.data();
+      }
+
+      // splits node over [b, e) down to single primitives. the larger child is split
+      // in the loop and the smaller one by recursion, which keeps the stack at log N,
+      // unless it is big enough to be worth a task of its own
+      void build(task_scheduler &scheduler, int worker, uint node, int b, int e)
+      {
+        while (true)
+        {
+          int m = split(b, e);
+          uint2 range[2] = {{uint(b), uint(m)}, {uint(m), uint(e)}};
+          uint child[2];
+          for (int c = 0; c < 2; c++)
+          {
+            uint n = range[c][1] - range[c][0];
+            child[c] = n == 1 ? leaf_start + refs[range[c][0]].id : next.fetch_add(1, std::memory_order_relaxed);
+          }
+          children[node] = {child[0], child[1]};
+
+          int big = m - b > e - m ? 0 : 1, small = 1 - big;
+          if (!is_leaf(child[small], leaf_start))
+          {
+            uint c = child[small];
+            int cb = range[small][0], ce = range[small][1];
+            if (ce - cb > grain)
+              scheduler.spawn(worker, [this, &scheduler, c, cb, ce](int w)
+                              { build(scheduler, w, c, cb, ce); });
+            else
+              build(scheduler, worker, c, cb, ce);
+          }
+          if (is_leaf(child[big], leaf_start))
+            return;
+          node = child[big];
+          b = range[big][0];
+          e = range[big][1];
+        }
+      }
+    };
+  } // namespace detail
+
+  // top down binned SAH build, Wald 2007. every node is cut where the surface area
+  // heuristic of its children is lowest among the bin boundaries of all three axes,
+  // which gives the best trees of the builders here at several times the cost of
+  // build_tree, for scenes that are built once and queried many times. subtrees are
+  // built as tasks on the work stealing scheduler, the first levels only have a few
+  // large nodes and run on fewer threads.
+  // boxes[i] and the centroid i belong to primitive i, leaves hold a single primitive
+  // like everywhere else and the tree comes out in the karras order, so every query
+  // runs on it unchanged
+  aabb_tree build_binned_sah(const std::vector<extents_3> &boxes, const centroids &cens,
+                             const sah_settings &settings = {})
+  {
+    int N = boxes.size();
+    aabb_tree tree;
+    if (N == 0)
+      return tree;
+
+    detail::sah_builder builder(boxes, cens, settings);
+    uint root = N == 1 ? builder.leaf_start : 0;
+    if (N > 1)
+    {
+      task_scheduler scheduler;
+      scheduler.run([&](int w)
+                    { builder.build(scheduler, w, 0, 0, N); });
+    }
+
+    std::vector<int> ids(N);
+    for (int i = 0; i < N; i++)
+      ids[i] = i;
+    std::vector<uint> remap;
+    tree.nodes = layout_tree(root, builder.children, ids, tree.ids, remap);
+
+    std::vector<extents_3> leaves(N);
+    parallel_for(0, N, [&](int j)
+                 { leaves[j] = boxes[tree.ids[j]]; });
+    tree.extents = build_pyramid_bottom_up<extents_3>(
+        leaves, tree.nodes,
+        []()
+        { return ext::init(); },
+        [](const extents_3 &a, const extents_3 &b)
+        { return pyramid(a, b); });
+    return tree;
+  }
+
+  // build_aabb_tree with the binned SAH builder
+  template <primitive_set P>
+  aabb_tree build_sah_tree(const P &prims, const sah_settings &settings = {})
+  {
+    int N = prims.size();
+    if (N == 0)
+      return aabb_tree();
+    centroids cens;
+    calc_centroids(prims, cens);
+    std::vector<extents_3> boxes(N);
+    parallel_for(0, N, [&](int i)
+                 { boxes[i] = prims.bounds(i); });
+    return build_binned_sah(boxes, cens, settings);
+  }
+
+  // build_sah_tree over primitives of STRIDE indices into x
+  template <int STRIDE>
+  aabb_tree build_sah_tree(const std::vector<int> &indices, const std::vector<vec3> &x,
+                           const sah_settings &settings = {})
+  {
+    return build_sah_tree(simplex_set<real, STRIDE>(indices, x), settings);
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef __MONDIAN_COMPRESSED_BVH__
+#define __MONDIAN_COMPRESSED_BVH__
+
+#include <bit>
+#include <cmath>
+
+#include "wide_bvh.hpp"
+
+namespace mondrian
+{
+  // bvh8_node with the child boxes quantized against the node's own box, Ylitie et al.
+  // 2017. per axis the box is origin + q * 2^exponent with q an 8 or 16 bit integer,
+  // lower bounds are rounded down and upper bounds up so a child box only ever grows.
+  // 104 bytes with uint8_t and 152 with uint16_t against 256 for bvh8_node
+  template <typename Q>
+  struct alignas(8) bvh8q_node
+  {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t n_children;
+    Q qmin_x[8], qmin_y[8], qmin_z[8];
+    Q qmax_x[8], qmax_y[8], qmax_z[8];
+    uint child[8];
+    uint8_t count[8];
+  };
+
+  using bvh8q8_node = bvh8q_node<uint8_t>;
+  using bvh8q16_node = bvh8q_node<uint16_t>;
+
+  static_assert(sizeof(bvh8q8_node) == 104, "bvh8q8_node should stay 104 bytes");
+  static_assert(sizeof(bvh8q16_node) == 152, "bvh8q16_node should stay 152 bytes");
+
+  namespace detail
+  {
+    // 2^e for a normal float exponent, built from the bits instead of calling ldexp
+    inline float pow2(int e) { return std::bit_cast<float>(uint32_t(e + 127) << 23); }
+
+    // q * 2^e is exact in float, so this rounds once, the same as the fma / mul add
+    // in the kernels
+    inline float dequantize(float origin, float scale, uint q) { return origin + float(q) * scale; }
+
+    // quantizes the child bounds along one axis, grows the step until every bound
+    // is covered after rounding
+    template <typename Q>
+    void quantize_axis(const float *cmin, const float *cmax, int n, Q *qmin, Q *qmax,
+                       float &origin, int8_t &exponent)
+    {
+      const uint max_q = std::numeric_limits<Q>::max();
+      float lo = ext::inf_t, hi = -ext::inf_t;
+      for (int j = 0; j < n; j++)
+        lo = std::min(lo, cmin[j]), hi = std::max(hi, cmax[j]);
+      origin = lo;
+
+      // smallest power of two step with max_q steps covering the range. tiny ranges
+      // give exponents below what pow2 can build, those start at the smallest normal
+      int e = -126;
+      double range = double(hi) - double(lo);
+      if (range > 0.0)
+        std::frexp(range / max_q, &e);
+      e = std::max(e, -126);
+
+      bool covered = false;
+      for (; e <= 127; e++)
+      {
+        float scale = pow2(e);
+        covered = true;
+        for (int j = 0; j < n; j++)
+        {
+          double l = std::floor((double(cmin[j]) - lo) / scale);
+          double h = std::ceil((double(cmax[j]) - lo) / scale);
+          uint ql = uint(std::clamp(l, 0.0, double(max_q)));
+          uint qh = uint(std::clamp(h, 0.0, double(max_q)));
+          // float rounding of the dequantized bound, step outwards until it covers
+          while (ql > 0 && dequantize(lo, scale, ql) > cmin[j])
+            ql--;
+          while (qh < max_q && dequantize(lo, scale, qh) < cmax[j])
+            qh++;
+          if (dequantize(lo, scale, qh) < cmax[j])
+          {
+            covered = false;
+            break;
+          }
+          qmin[j] = ql;
+          qmax[j] = qh;
+        }
+        if (covered)
+          break;
+      }
+      exponent = std::min(e, 127);
+      // nothing covered the range, max_q * 2^127 overflows to inf so the full range
+      // box holds any finite bound
+      if (!covered)
+        for (int j = 0; j < n; j++)
+          qmin[j] = 0, qmax[j] = max_q;
+      // unused slots are left as empty boxes, the kernels mask them out anyway
+      for (int j = n; j < 8; j++)
+        qmin[j] = max_q, qmax[j] = 0;
+    }
+  } // namespace detail
+
+  template <typename Q>
+  bvh8q_node<Q> compress_node(const bvh8_node &w)
+  {
+    bvh8q_node<Q> q = {};
+    q.n_children = w.n_children;
+    detail::quantize_axis<Q>(w.min_x, w.max_x, w.n_children, q.qmin_x, q.qmax_x, q.origin[0], q.exponent[0]);
+    detail::quantize_axis<Q>(w.min_y, w.max_y, w.n_children, q.qmin_y, q.qmax_y, q.origin[1], q.exponent[1]);
+    detail::quantize_axis<Q>(w.min_z, w.max_z, w.n_children, q.qmin_z, q.qmax_z, q.origin[2], q.exponent[2]);
+    for (int j = 0; j < 8; j++)
+    {
+      q.child[j] = w.child[j];
+      q.count[j] = w.count[j];
+    }
+    return q;
+  }
+
+  // same topology and leaf ranges as the uncompressed tree, only the boxes change
+  template <typename Q>
+  std::vector<bvh8q_node<Q>> compress_bvh8(const std::vector<bvh8_node> &wide)
+  {
+    std::vector<bvh8q_node<Q>> out(wide.size());
+    parallel_for(
+        0, int(wide.size()), [&](int i)
+        { out[i] = compress_node<Q>(wide[i]); },
+        1024);
+    return out;
+  }
+
+  // the conservative box of slot j
+  template <typename Q>
+  ext::extents_t dequantize(const bvh8q_node<Q> &w, int j)
+  {
+    float sx = detail::pow2(w.exponent[0]);
+    float sy = detail::pow2(w.exponent[1]);
+    float sz = detail::pow2(w.exponent[2]);
+    return {vec3(detail::dequantize(w.origin[0], sx, w.qmin_x[j]),
+                 detail::dequantize(w.origin[1], sy, w.qmin_y[j]),
+                 detail::dequantize(w.origin[2], sz, w.qmin_z[j])),
+            vec3(detail::dequantize(w.origin[0], sx, w.qmax_x[j]),
+                 detail::dequantize(w.origin[1], sy, w.qmax_y[j]),
+                 detail::dequantize(w.origin[2], sz, w.qmax_z[j]))};
+  }
+
+  template <typename Q>
+  inline uint ray_box8_scalar(const bvh8q_node<Q> &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    uint mask = 0;
+    for (int j = 0; j < w.n_children; j++)
+      if (ray_box(r, dequantize(w, j), tmin, tmax, tnear[j]))
+        mask |= 1u << j;
+    return mask;
+  }
+
+#if defined(__AVX2__)
+  // 8 quantized bounds widened to float and moved into world space
+  template <typename Q>
+  inline __m256 dequantize8_avx2(const Q *q, __m256 origin, __m256 scale)
+  {
+    __m256i qi;
+    if constexpr (sizeof(Q) == 1)
+      qi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)q));
+    else
+      qi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)q));
+    return _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(qi), scale), origin);
+  }
+
+  template <typename Q>
+  inline uint ray_box8_avx2(const bvh8q_node<Q> &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    const __m256 ox = _mm256_set1_ps(w.origin[0]), oy = _mm256_set1_ps(w.origin[1]), oz = _mm256_set1_ps(w.origin[2]);
+    const __m256 sx = _mm256_set1_ps(detail::pow2(w.exponent[0]));
+    const __m256 sy = _mm256_set1_ps(detail::pow2(w.exponent[1]));
+    const __m256 sz = _mm256_set1_ps(detail::pow2(w.exponent[2]));
+    uint mask = slab8_avx2(dequantize8_avx2(w.qmin_x, ox, sx), dequantize8_avx2(w.qmin_y, oy, sy),
+                           dequantize8_avx2(w.qmin_z, oz, sz), dequantize8_avx2(w.qmax_x, ox, sx),
+                           dequantize8_avx2(w.qmax_y, oy, sy), dequantize8_avx2(w.qmax_z, oz, sz),
+                           r, tmin, tmax, tnear);
+    return mask & ((1u << w.n_children) - 1);
+  }
+#endif
+
+  // picked up by traverse_bvh8, the widening needs AVX2 so SSE only builds use the
+  // scalar path
+  template <typename Q>
+  inline uint ray_box8(const bvh8q_node<Q> &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+#if defined(__AVX2__)
+    return ray_box8_avx2(w, r, tmin, tmax, tnear);
+#else
+    return ray_box8_scalar(w, r, tmin, tmax, tnear);
+#endif
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,494 @@
+#ifndef __MONDIAN_DYNAMIC_TREE__
+#define __MONDIAN_DYNAMIC_TREE__
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "overlap.hpp"
+
+namespace mondrian
+{
+  // node of the dynamic tree, leaves keep the tight box of their primitive next to the
+  // fat box the tree is built from. free nodes are chained through parent
+  struct dynamic_tree_node
+  {
+    extents_3 fat = ext::init();
+    extents_3 tight = ext::init();
+    uint parent = UNULL;
+    uint child[2] = {UNULL, UNULL};
+    int height = 0; // -1 when free
+    int id = -1;
+
+    bool leaf() const { return child[0] == UNULL; }
+  };
+
+  // incremental tree for scenes where primitives come and go every frame. leaves are
+  // stored with their box inflated by margin so small motions don't touch the tree,
+  // insert picks the sibling with the lowest area cost and every node on the way back
+  // up tries the child / grandchild swaps that shrink it (Kopta et al. 2012). insert,
+  // remove and update are O(log N) on a balanced tree. the handle returned by insert
+  // is stable until the primitive is removed
+  class dynamic_tree
+  {
+  public:
+    typedef std::shared_ptr<dynamic_tree> ptr;
+
+    static ptr create(real margin = 0.1) { return std::make_shared<dynamic_tree>(margin); }
+
+    dynamic_tree(real margin = 0.1) : _margin(margin) {}
+
+    uint insert(const extents_3 &box, int id)
+    {
+      uint leaf = _alloc();
+      _nodes[leaf].tight = box;
+      _nodes[leaf].fat = ext::inflate(box, _margin);
+      _nodes[leaf].id = id;
+      _insert_leaf(leaf);
+      _size++;
+      return leaf;
+    }
+
+    void remove(uint leaf)
+    {
+      assert(leaf < _nodes.size() && _nodes[leaf].leaf() && _nodes[leaf].height == 0);
+      _remove_leaf(leaf);
+      _free(leaf);
+      _size--;
+    }
+
+    // new box for a primitive, it only leaves and reenters the tree when the box
+    // moved out of its fat box. returns true when the tree changed
+    bool update(uint leaf, const extents_3 &box)
+    {
+      dynamic_tree_node &n = _nodes[leaf];
+      n.tight = box;
+      if (ext::contains(n.fat, box))
+        return false;
+      _remove_leaf(leaf);
+      _nodes[leaf].fat = ext::inflate(box, _margin);
+      _insert_leaf(leaf);
+      return true;
+    }
+
+    void clear()
+    {
+      _nodes.clear();
+      _root = UNULL;
+      _free_list = UNULL;
+      _size = 0;
+    }
+
+    // calls hit(id) for every primitive whose box overlaps q
+    template <typename HIT>
+    void query(const extents_3 &q, HIT &&hit) const
+    {
+      if (_root == UNULL)
+        return;
+      std::vector<uint> stack = {_root};
+      while (stack.size() > 0)
+      {
+        const dynamic_tree_node &n = _nodes[stack.back()];
+        stack.pop_back();
+        if (!ext::overlap(n.fat, q))
+          continue;
+        if (n.leaf())
+        {
+          if (ext::overlap(n.tight, q))
+            hit(n.id);
+          continue;
+        }
+        stack.push_back(n.child[0]);
+        stack.push_back(n.child[1]);
+      }
+    }
+
+    // ray traversal, leaf(id, tmax) is called for every primitive box the ray enters
+    // before tmax, it may shrink tmax (closest hit) and returns true to stop (any hit)
+    template <typename LEAF>
+    void raycast(const ray_t &r, real tmax, LEAF &&leaf) const
+    {
+      if (_root == UNULL)
+        return;
+      std::vector<uint> stack = {_root};
+      while (stack.size() > 0)
+      {
+        const dynamic_tree_node &n = _nodes[stack.back()];
+        stack.pop_back();
+        real tnear;
+        if (!ray_box(r, n.leaf() ? n.tight : n.fat, 0.0, tmax, tnear))
+          continue;
+        if (n.leaf())
+        {
+          if (leaf(n.id, tmax))
+            return;
+          continue;
+        }
+        stack.push_back(n.child[0]);
+        stack.push_back(n.child[1]);
+      }
+    }
+
+    // appends the id of every primitive whose box is within r of p
+    void radius_query(const vec3 &p, real r, std::vector<int> &out) const
+    {
+      if (_root == UNULL)
+        return;
+      real r2 = r * r;
+      std::vector<uint> stack = {_root};
+      while (stack.size() > 0)
+      {
+        const dynamic_tree_node &n = _nodes[stack.back()];
+        stack.pop_back();
+        if (ext::distance2(n.leaf() ? n.tight : n.fat, p) > r2)
+          continue;
+        if (n.leaf())
+        {
+          out.push_back(n.id);
+          continue;
+        }
+        stack.push_back(n.child[0]);
+        stack.push_back(n.child[1]);
+      }
+    }
+
+    // the k primitives whose boxes are closest to p, nearest first
+    std::vector<int> knn(const vec3 &p, int k) const
+    {
+      if (_root == UNULL || k <= 0)
+        return {};
+      std::vector<std::pair<real, int>> heap;
+      heap.reserve(k + 1);
+      auto worst = [&]()
+      { return int(heap.size()) < k ? std::numeric_limits<real>::max() : heap.front().first; };
+
+      std::vector<std::pair<real, uint>> stack = {{0.0, _root}};
+      while (stack.size() > 0)
+      {
+        auto [d2, i] = stack.back();
+        stack.pop_back();
+        if (d2 > worst())
+          continue;
+        const dynamic_tree_node &n = _nodes[i];
+        if (n.leaf())
+        {
+          real dl = ext::distance2(n.tight, p);
+          if (dl > worst())
+            continue;
+          heap.push_back({dl, n.id});
+          std::push_heap(heap.begin(), heap.end());
+          if (heap.size() > k)
+          {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+          }
+          continue;
+        }
+        uint l = n.child[0], r = n.child[1];
+        real dl = ext::distance2(_nodes[l].fat, p);
+        real dr = ext::distance2(_nodes[r].fat, p);
+        if (dl < dr)
+          std::swap(l, r), std::swap(dl, dr);
+        stack.push_back({dl, l});
+        stack.push_back({dr, r});
+      }
+
+      std::sort_heap(heap.begin(), heap.end());
+      std::vector<int> out(heap.size());
+      for (int j = 0; j < heap.size(); j++)
+        out[j] = heap[j].second;
+      return out;
+    }
+
+    // broadphase self collision, every pair of primitives whose boxes are within eps,
+    // reported once with the smaller handle first
+    std::vector<prim_pair> find_overlapping_pairs(real eps = 0.0) const
+    {
+      std::vector<uint> leaves = this->leaves();
+      int N = leaves.size();
+      if (N < 2)
+        return {};
+      int n_chunks = num_chunks(N, 256);
+      std::vector<std::vector<prim_pair>> buffers(n_chunks);
+      parallel_for_chunks(
+          0, N, n_chunks, [&](int t, int b, int e)
+          {
+            std::vector<prim_pair> &pairs = buffers[t];
+            std::vector<uint> stack;
+            for (int i = b; i < e; i++)
+            {
+              uint li = leaves[i];
+              ext::extents_t q = ext::inflate(_nodes[li].tight, eps);
+              stack.clear();
+              stack.push_back(_root);
+              while (stack.size() > 0)
+              {
+                uint j = stack.back();
+                stack.pop_back();
+                const dynamic_tree_node &n = _nodes[j];
+                if (!ext::overlap(n.leaf() ? n.tight : n.fat, q))
+                  continue;
+                if (n.leaf())
+                {
+                  if (j > li)
+                    pairs.push_back({_nodes[li].id, n.id});
+                  continue;
+                }
+                stack.push_back(n.child[0]);
+                stack.push_back(n.child[1]);
+              }
+            } });
+      return detail::concat(buffers);
+    }
+
+    // handles of every primitive in the tree
+    std::vector<uint> leaves() const
+    {
+      std::vector<uint> out;
+      out.reserve(_size);
+      for (uint i = 0; i < _nodes.size(); i++)
+        if (_nodes[i].height == 0)
+          out.push_back(i);
+      return out;
+    }
+
+    // same measure as sah_cost on the static tree, over the fat boxes
+    real sah_cost(real c_inner = 1.2, real c_leaf = 1.0) const
+    {
+      if (_root == UNULL)
+        return 0.0;
+      double cost = 0.0;
+      for (const dynamic_tree_node &n : _nodes)
+        if (n.height >= 0)
+          cost += (n.height == 0 ? c_leaf : c_inner) * ext::area(n.fat);
+      real root_area = ext::area(_nodes[_root].fat);
+      return root_area > 0.0 ? real(cost / root_area) : 0.0;
+    }
+
+    int height() const { return _root == UNULL ? 0 : _nodes[_root].height; }
+    int size() const { return _size; }
+    uint root() const { return _root; }
+    real margin() const { return _margin; }
+    int id(uint leaf) const { return _nodes[leaf].id; }
+    const extents_3 &fat_extents(uint i) const { return _nodes[i].fat; }
+    const extents_3 &tight_extents(uint leaf) const { return _nodes[leaf].tight; }
+    const std::vector<dynamic_tree_node> &nodes() const { return _nodes; }
+
+  protected:
+    uint _alloc()
+    {
+      if (_free_list == UNULL)
+      {
+        _nodes.push_back(dynamic_tree_node());
+        return _nodes.size() - 1;
+      }
+      uint i = _free_list;
+      _free_list = _nodes[i].parent;
+      _nodes[i] = dynamic_tree_node();
+      return i;
+    }
+
+    void _free(uint i)
+    {
+      _nodes[i].parent = _free_list;
+      _nodes[i].height = -1;
+      _nodes[i].child[0] = _nodes[i].child[1] = UNULL;
+      _free_list = i;
+    }
+
+    // branch and bound over the whole tree, Bittner et al. 2013. making box the sibling
+    // of a node costs the area of their union plus the growth of every ancestor above
+    // it (the inherited cost). nothing below a node can cost less than the area of box
+    // plus the inherited cost of its children, nodes are expanded cheapest bound first
+    // and subtrees whose bound can't beat the best sibling so far are skipped
+    uint _pick_sibling(const extents_3 &box) const
+    {
+      real box_area = ext::area(box);
+      uint best = _root;
+      real best_cost = ext::area(pyramid(_nodes[_root].fat, box));
+
+      // min heap of (inherited cost, node)
+      auto later = [](const std::pair<real, uint> &a, const std::pair<real, uint> &b)
+      { return a.first > b.first; };
+      std::vector<std::pair<real, uint>> &heap = _heap;
+      heap.clear();
+      heap.push_back({0.0f, _root});
+      while (heap.size() > 0)
+      {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        auto [inherited, i] = heap.back();
+        heap.pop_back();
+        // every node left has at least this inherited cost
+        if (box_area + inherited >= best_cost)
+          break;
+
+        const dynamic_tree_node &n = _nodes[i];
+        real combined = ext::area(pyramid(n.fat, box));
+        real cost = combined + inherited;
+        if (cost < best_cost)
+        {
+          best_cost = cost;
+          best = i;
+        }
+        if (n.leaf())
+          continue;
+
+        // pushing box further down grows i
+        real child_inherited = inherited + combined - ext::area(n.fat);
+        if (box_area + child_inherited >= best_cost)
+          continue;
+        for (int c = 0; c < 2; c++)
+        {
+          heap.push_back({child_inherited, n.child[c]});
+          std::push_heap(heap.begin(), heap.end(), later);
+        }
+      }
+      return best;
+    }
+
+    void _insert_leaf(uint leaf)
+    {
+      _nodes[leaf].parent = UNULL;
+      _nodes[leaf].height = 0;
+      if (_root == UNULL)
+      {
+        _root = leaf;
+        return;
+      }
+
+      uint sibling = _pick_sibling(_nodes[leaf].fat);
+      uint old_parent = _nodes[sibling].parent;
+      uint parent = _alloc();
+      _nodes[parent].parent = old_parent;
+      _nodes[parent].child[0] = sibling;
+      _nodes[parent].child[1] = leaf;
+      _nodes[sibling].parent = parent;
+      _nodes[leaf].parent = parent;
+
+      if (old_parent == UNULL)
+        _root = parent;
+      else
+        _replace_child(old_parent, sibling, parent);
+
+      _refit_up(parent);
+    }
+
+    void _remove_leaf(uint leaf)
+    {
+      if (leaf == _root)
+      {
+        _root = UNULL;
+        return;
+      }
+      uint parent = _nodes[leaf].parent;
+      uint grand = _nodes[parent].parent;
+      uint sibling = _nodes[parent].child[0] == leaf ? _nodes[parent].child[1] : _nodes[parent].child[0];
+
+      _nodes[sibling].parent = grand;
+      _free(parent);
+      _nodes[leaf].parent = UNULL;
+      if (grand == UNULL)
+      {
+        _root = sibling;
+        return;
+      }
+      _replace_child(grand, parent, sibling);
+      _refit_up(grand);
+    }
+
+    void _replace_child(uint parent, uint old_child, uint new_child)
+    {
+      dynamic_tree_node &p = _nodes[parent];
+      p.child[p.child[0] == old_child ? 0 : 1] = new_child;
+      _nodes[new_child].parent = parent;
+    }
+
+    void _fix(uint i)
+    {
+      dynamic_tree_node &n = _nodes[i];
+      const dynamic_tree_node &l = _nodes[n.child[0]];
+      const dynamic_tree_node &r = _nodes[n.child[1]];
+      n.fat = pyramid(l.fat, r.fat);
+      n.height = 1 + std::max(l.height, r.height);
+    }
+
+    void _refit_up(uint i)
+    {
+      while (i != UNULL)
+      {
+        _fix(i);
+        _rotate(i);
+        i = _nodes[i].parent;
+      }
+    }
+
+    // exchanges two nodes from different subtrees of the same node
+    void _swap(uint x, uint y)
+    {
+      uint px = _nodes[x].parent, py = _nodes[y].parent;
+      _replace_child(px, x, y);
+      _replace_child(py, y, x);
+    }
+
+    // tries swapping a child of a with a grandchild on the other side, or two grandchildren
+    // across, and applies the swap that shrinks the children of a the most. only the boxes
+    // of b and c change, so the gain is measured on them alone
+    void _rotate(uint a)
+    {
+      uint b = _nodes[a].child[0], c = _nodes[a].child[1];
+      bool b_inner = !_nodes[b].leaf(), c_inner = !_nodes[c].leaf();
+      if (!b_inner && !c_inner)
+        return;
+
+      auto area = [&](uint i, uint j)
+      { return ext::area(pyramid(_nodes[i].fat, _nodes[j].fat)); };
+
+      real area_b = ext::area(_nodes[b].fat), area_c = ext::area(_nodes[c].fat);
+      real best = 0.0;
+      uint bx = UNULL, by = UNULL;
+      auto consider = [&](real gain, uint x, uint y)
+      {
+        if (gain > best)
+          best = gain, bx = x, by = y;
+      };
+
+      if (c_inner)
+      {
+        uint f = _nodes[c].child[0], g = _nodes[c].child[1];
+        consider(area_c - area(b, g), b, f);
+        consider(area_c - area(b, f), b, g);
+      }
+      if (b_inner)
+      {
+        uint d = _nodes[b].child[0], e = _nodes[b].child[1];
+        consider(area_b - area(c, e), c, d);
+        consider(area_b - area(c, d), c, e);
+      }
+      if (b_inner && c_inner)
+      {
+        uint d = _nodes[b].child[0], e = _nodes[b].child[1];
+        uint f = _nodes[c].child[0], g = _nodes[c].child[1];
+        consider(area_b + area_c - area(f, e) - area(d, g), d, f);
+        consider(area_b + area_c - area(g, e) - area(f, d), d, g);
+      }
+      if (bx == UNULL)
+        return;
+
+      _swap(bx, by);
+      if (b_inner && _nodes[b].parent == a && bx != b && by != b)
+        _fix(b);
+      if (c_inner && _nodes[c].parent == a && bx != c && by != c)
+        _fix(c);
+      _fix(a);
+    }
+
+    std::vector<dynamic_tree_node> _nodes;
+    uint _root = UNULL;
+    uint _free_list = UNULL;
+    int _size = 0;
+    real _margin;
+    // search queue of _pick_sibling, kept so inserts don't allocate
+    mutable std::vector<std::pair<real, uint>> _heap;
+  };
+
+} // mondrian
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef __MONDIAN_FLAT_BVH__
+#define __MONDIAN_FLAT_BVH__
+
+#include <cstddef>
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // fused node for traversal and upload, both child boxes live inline so a traversal step
+  // reads one 64 byte cache line instead of a topology node plus two extents.
+  // the layout is std430 compatible and matches FlatBvhNode in assets/bvh.wgsl byte for byte,
+  // every vec3 is followed by a u32 so nothing gets padded.
+  // a child with count == 0 is the index of another flat node, otherwise it is the
+  // range [child, child + count) of leaves in the sorted ids order
+  struct alignas(64) flat_bvh_node
+  {
+    vec3 l_min;
+    uint l_child;
+    vec3 l_max;
+    uint l_count;
+    vec3 r_min;
+    uint r_child;
+    vec3 r_max;
+    uint r_count;
+  };
+
+  static_assert(sizeof(flat_bvh_node) == 64, "flat_bvh_node must match the 64 byte wgsl struct");
+  static_assert(offsetof(flat_bvh_node, l_child) == 12 && offsetof(flat_bvh_node, l_max) == 16 &&
+                    offsetof(flat_bvh_node, r_min) == 32 && offsetof(flat_bvh_node, r_max) == 48,
+                "flat_bvh_node must match the std430 layout of FlatBvhNode");
+
+  // lays the internal nodes out depth first, a left child always sits right after its parent
+  // so going left is a sequential read. extents is the pyramid from build_pyramid(_bottom_up)
+  std::vector<flat_bvh_node> flatten_tree(const std::vector<radix_tree_node> &nodes,
+                                          const std::vector<extents_3> &extents)
+  {
+    uint leaf_start = get_leaf_start(nodes);
+    std::vector<flat_bvh_node> flat;
+    flat.reserve(std::max(leaf_start, uint(1)));
+
+    auto set_child = [&](flat_bvh_node &f, int side, uint child, uint flat_index)
+    {
+      const extents_3 &e = extents[child];
+      bool leaf = is_leaf(child, leaf_start);
+      uint ref = leaf ? child - leaf_start : flat_index;
+      uint count = leaf ? 1 : 0;
+      if (side == 0)
+        f.l_min = e[0], f.l_max = e[1], f.l_child = ref, f.l_count = count;
+      else
+        f.r_min = e[0], f.r_max = e[1], f.r_child = ref, f.r_count = count;
+    };
+
+    if (leaf_start == 0)
+    {
+      // a single primitive, the right child is parked at infinity where neither
+      // overlap nor slab tests can reach it (an inverted box would pass the slab test)
+      flat_bvh_node f;
+      set_child(f, 0, 0, 0);
+      f.r_min = ext::inf_3, f.r_max = ext::inf_3, f.r_child = UNULL, f.r_count = 0;
+      flat.push_back(f);
+      return flat;
+    }
+
+    // (radix node, flat parent, side in the parent)
+    std::vector<std::array<uint, 3>> stack = {{0, UNULL, 0}};
+    while (stack.size() > 0)
+    {
+      auto [i, parent, side] = stack.back();
+      stack.pop_back();
+
+      uint fi = flat.size();
+      flat.push_back(flat_bvh_node());
+      if (parent != UNULL)
+        (side == 0 ? flat[parent].l_child : flat[parent].r_child) = fi;
+
+      uint l = left_child(nodes[i], leaf_start);
+      uint r = right_child(nodes[i], leaf_start);
+      set_child(flat[fi], 0, l, UNULL);
+      set_child(flat[fi], 1, r, UNULL);
+      // right first so the left child is popped, and placed, next
+      if (!is_leaf(r, leaf_start))
+        stack.push_back({r, fi, 1});
+      if (!is_leaf(l, leaf_start))
+        stack.push_back({l, fi, 0});
+    }
+    return flat;
+  }
+
+  // entries of the traversal stack in assets/bvh.wgsl. only internal nodes are pushed
+  // and every level leaves at most one sibling behind, so a tree whose leaves are no
+  // deeper than this never overflows it. deeper trees (skewed ploc, binned sah or
+  // heavily clustered inputs) raise the stack_overflow flag there instead
+  const uint wgsl_stack_size = 64;
+
+  inline bool fits_wgsl_stack(const std::vector<radix_tree_node> &nodes)
+  {
+    return tree_depth(nodes)[0] <= wgsl_stack_size;
+  }
+
+  // walks the flat tree, test(min, max) decides whether to enter a child box and
+  // leaf(first, count) is called for every leaf range that passes
+  template <typename TEST, typename LEAF>
+  void traverse_flat(const std::vector<flat_bvh_node> &flat, TEST &&test, LEAF &&leaf)
+  {
+    if (flat.empty())
+      return;
+    std::vector<uint> stack = {0};
+    while (stack.size() > 0)
+    {
+      const flat_bvh_node &f = flat[stack.back()];
+      stack.pop_back();
+      if (test(f.r_min, f.r_max))
+      {
+        if (f.r_count > 0)
+          leaf(f.r_child, f.r_count);
+        else
+          stack.push_back(f.r_child);
+      }
+      if (test(f.l_min, f.l_max))
+      {
+        if (f.l_count > 0)
+          leaf(f.l_child, f.l_count);
+        else
+          stack.push_back(f.l_child);
+      }
+    }
+  }
+
+} // mondrian
+
+#endif
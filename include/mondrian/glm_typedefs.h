@@ -9,7 +9,7 @@
 
 using vec3 = glm::vec3;
 
-inline float norm(const vec3 &p) { return p.length(); }
+inline float norm(const vec3 &p) { return glm::length(p); }
 inline vec3 max(const vec3 &A, const vec3 &B)
 {
   return vec3(std::max(A[0], B[0]),
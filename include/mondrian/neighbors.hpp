@@ -0,0 +1,184 @@
+#ifndef __MONDIAN_NEIGHBORS__
+#define __MONDIAN_NEIGHBORS__
+
+#include <numeric>
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // tree over a point cloud, primitive i is the point x[i]
+  aabb_tree build_point_tree(const std::vector<vec3> &x)
+  {
+    std::vector<int> indices(x.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    return build_aabb_tree<1>(indices, x);
+  }
+
+  // compressed sparse rows, the neighbors of point i are
+  // neighbors[offsets[i]] ... neighbors[offsets[i + 1] - 1]
+  struct neighbor_lists
+  {
+    std::vector<int> offsets;
+    std::vector<int> neighbors;
+
+    int size() const { return int(offsets.size()) - 1; }
+    int count(int i) const { return offsets[i + 1] - offsets[i]; }
+    const int *begin(int i) const { return neighbors.data() + offsets[i]; }
+    const int *end(int i) const { return neighbors.data() + offsets[i + 1]; }
+  };
+
+  // appends every point within r of p to out, skipping exclude
+  void radius_query(aabb_tree_view tree, const std::vector<vec3> &x, const vec3 &p, real r,
+                    std::vector<int> &out, int exclude = -1)
+  {
+    if (tree.size() == 0)
+      return;
+    uint leaf_start = tree.leaf_start();
+    real r2 = r * r;
+    std::vector<uint> stack = {0};
+    while (stack.size() > 0)
+    {
+      uint i = stack.back();
+      stack.pop_back();
+
+      if (ext::distance2(tree.extents[i], p) > r2)
+        continue;
+      if (is_leaf(i, leaf_start))
+      {
+        int id = tree.ids[i - leaf_start];
+        vec3 d = x[id] - p;
+        if (id != exclude && glm::dot(d, d) <= r2)
+          out.push_back(id);
+        continue;
+      }
+      stack.push_back(left_child(tree.nodes[i], leaf_start));
+      stack.push_back(right_child(tree.nodes[i], leaf_start));
+    }
+  }
+
+  // the k points closest to p sorted nearest first, skipping exclude.
+  // nearer children are visited first so the k-th distance shrinks quickly and prunes
+  std::vector<int> knn(aabb_tree_view tree, const std::vector<vec3> &x, const vec3 &p, int k, int exclude = -1)
+  {
+    if (tree.size() == 0 || k <= 0)
+      return {};
+    uint leaf_start = tree.leaf_start();
+
+    // max heap on distance, the root is the current k-th neighbor
+    std::vector<std::pair<real, int>> heap;
+    heap.reserve(k + 1);
+    auto worst = [&]()
+    { return int(heap.size()) < k ? std::numeric_limits<real>::max() : heap.front().first; };
+
+    std::vector<std::pair<real, uint>> stack = {{0.0, 0}};
+    while (stack.size() > 0)
+    {
+      auto [d2, i] = stack.back();
+      stack.pop_back();
+      if (d2 > worst())
+        continue;
+      if (is_leaf(i, leaf_start))
+      {
+        int id = tree.ids[i - leaf_start];
+        vec3 d = x[id] - p;
+        if (id == exclude || glm::dot(d, d) > worst())
+          continue;
+        heap.push_back({glm::dot(d, d), id});
+        std::push_heap(heap.begin(), heap.end());
+        if (heap.size() > k)
+        {
+          std::pop_heap(heap.begin(), heap.end());
+          heap.pop_back();
+        }
+        continue;
+      }
+      uint l = left_child(tree.nodes[i], leaf_start);
+      uint r = right_child(tree.nodes[i], leaf_start);
+      real dl = ext::distance2(tree.extents[l], p);
+      real dr = ext::distance2(tree.extents[r], p);
+      // push the far child first so the near one is popped next
+      if (dl < dr)
+        std::swap(l, r), std::swap(dl, dr);
+      stack.push_back({dl, l});
+      stack.push_back({dr, r});
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+    std::vector<int> out(heap.size());
+    for (int j = 0; j < heap.size(); j++)
+      out[j] = heap[j].second;
+    return out;
+  }
+
+  namespace detail
+  {
+    // runs query(point, row) for every point in order, a morton order so neighboring
+    // queries touch the same nodes, and scatters the rows into CSR lists indexed by point
+    template <typename QUERY>
+    neighbor_lists build_neighbor_lists(std::span<const int> order, QUERY &&query)
+    {
+      int N = order.size();
+      neighbor_lists lists;
+      lists.offsets.assign(N + 1, 0);
+      if (N == 0)
+        return lists;
+
+      // per chunk rows, in morton order
+      int n_chunks = num_chunks(N, 1024);
+      std::vector<std::vector<int>> chunk_rows(n_chunks), chunk_offsets(n_chunks);
+      std::vector<int> chunk_begin(n_chunks, 0);
+      parallel_for_chunks(
+          0, N, n_chunks, [&](int t, int b, int e)
+          {
+            chunk_begin[t] = b;
+            std::vector<int> &rows = chunk_rows[t];
+            std::vector<int> &offsets = chunk_offsets[t];
+            offsets.push_back(0);
+            for (int j = b; j < e; j++)
+            {
+              query(order[j], rows);
+              offsets.push_back(rows.size());
+            } });
+
+      for (int t = 0; t < n_chunks; t++)
+        for (int j = 0; j + 1 < chunk_offsets[t].size(); j++)
+          lists.offsets[order[chunk_begin[t] + j] + 1] = chunk_offsets[t][j + 1] - chunk_offsets[t][j];
+      for (int i = 0; i < N; i++)
+        lists.offsets[i + 1] += lists.offsets[i];
+
+      lists.neighbors.resize(lists.offsets[N]);
+      parallel_for(
+          0, n_chunks, [&](int t)
+          {
+            for (int j = 0; j + 1 < chunk_offsets[t].size(); j++)
+            {
+              int id = order[chunk_begin[t] + j];
+              std::copy(chunk_rows[t].begin() + chunk_offsets[t][j],
+                        chunk_rows[t].begin() + chunk_offsets[t][j + 1],
+                        lists.neighbors.begin() + lists.offsets[id]);
+            } },
+          1);
+      return lists;
+    }
+  } // namespace detail
+
+  // fixed radius neighbors of every point in the tree, a point is not its own neighbor
+  neighbor_lists radius_query_all(aabb_tree_view tree, const std::vector<vec3> &x, real r)
+  {
+    return detail::build_neighbor_lists(tree.ids, [&](int id, std::vector<int> &row)
+                                        { radius_query(tree, x, x[id], r, row, id); });
+  }
+
+  // k nearest neighbors of every point in the tree, nearest first
+  neighbor_lists knn_all(aabb_tree_view tree, const std::vector<vec3> &x, int k)
+  {
+    return detail::build_neighbor_lists(tree.ids, [&](int id, std::vector<int> &row)
+                                        {
+      std::vector<int> nn = knn(tree, x, x[id], k, id);
+      row.insert(row.end(), nn.begin(), nn.end()); });
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef __MONDIAN_OVERLAP__
+#define __MONDIAN_OVERLAP__
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  using prim_pair = std::array<int, 2>;
+
+  namespace detail
+  {
+    // walks tree with box q and calls hit(j) for every leaf position j whose box overlaps,
+    // subtrees whose leaf range ends at or before min_leaf are skipped
+    template <typename HIT>
+    void query_box(aabb_tree_view tree, const ext::extents_t &q, int min_leaf, std::vector<uint> &stack, HIT &&hit)
+    {
+      uint leaf_start = tree.leaf_start();
+      stack.clear();
+      stack.push_back(0);
+      while (stack.size() > 0)
+      {
+        uint i = stack.back();
+        stack.pop_back();
+        bool leaf = is_leaf(i, leaf_start);
+        int last = leaf ? i - leaf_start : tree.nodes[i].end;
+        if (last <= min_leaf || !ext::overlap(tree.extents[i], q))
+          continue;
+        if (leaf)
+        {
+          hit(last);
+          continue;
+        }
+        stack.push_back(left_child(tree.nodes[i], leaf_start));
+        stack.push_back(right_child(tree.nodes[i], leaf_start));
+      }
+    }
+
+    // each thread fills its own buffer, then the buffers are copied side by side
+    inline std::vector<prim_pair> concat(std::vector<std::vector<prim_pair>> &buffers)
+    {
+      std::vector<size_t> offsets(buffers.size() + 1, 0);
+      for (int t = 0; t < buffers.size(); t++)
+        offsets[t + 1] = offsets[t] + buffers[t].size();
+
+      std::vector<prim_pair> pairs(offsets.back());
+      parallel_for(
+          0, int(buffers.size()), [&](int t)
+          { std::copy(buffers[t].begin(), buffers[t].end(), pairs.begin() + offsets[t]); },
+          1);
+      return pairs;
+    }
+  } // namespace detail
+
+  // broadphase self collision, every pair of primitives whose boxes are within eps of each
+  // other, reported once as (ids[i], ids[j]) with leaf i before leaf j. every leaf walks
+  // the tree on its own and only looks at leaves after it, threads keep local buffers
+  std::vector<prim_pair> find_overlapping_pairs(aabb_tree_view tree, real eps = 0.0)
+  {
+    int N = tree.size();
+    if (N < 2)
+      return {};
+    uint leaf_start = tree.leaf_start();
+    int n_chunks = num_chunks(N, 256);
+    std::vector<std::vector<prim_pair>> buffers(n_chunks);
+    parallel_for_chunks(
+        0, N, n_chunks, [&](int t, int b, int e)
+        {
+          std::vector<prim_pair> &pairs = buffers[t];
+          std::vector<uint> stack;
+          for (int i = b; i < e; i++)
+          {
+            ext::extents_t q = ext::inflate(tree.extents[leaf_start + i], eps);
+            detail::query_box(tree, q, i, stack, [&](int j)
+                              { pairs.push_back({tree.ids[i], tree.ids[j]}); });
+          } });
+    return detail::concat(buffers);
+  }
+
+  // every pair (a, b) of a primitive in A and a primitive in B whose boxes are within eps
+  std::vector<prim_pair> find_overlapping_pairs(aabb_tree_view A, aabb_tree_view B, real eps = 0.0)
+  {
+    int N = A.size();
+    if (N == 0 || B.size() == 0)
+      return {};
+    uint leaf_start = A.leaf_start();
+    int n_chunks = num_chunks(N, 256);
+    std::vector<std::vector<prim_pair>> buffers(n_chunks);
+    parallel_for_chunks(
+        0, N, n_chunks, [&](int t, int b, int e)
+        {
+          std::vector<prim_pair> &pairs = buffers[t];
+          std::vector<uint> stack;
+          for (int i = b; i < e; i++)
+          {
+            ext::extents_t q = ext::inflate(A.extents[leaf_start + i], eps);
+            detail::query_box(B, q, -1, stack, [&](int j)
+                              { pairs.push_back({A.ids[i], B.ids[j]}); });
+          } });
+    return detail::concat(buffers);
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef __MONDIAN_PARALLEL__
+#define __MONDIAN_PARALLEL__
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mondrian
+{
+  // number of threads the parallel paths are allowed to use,
+  // 0 means use whatever the hardware reports. atomic because builds run on
+  // background threads (async_tree) while another thread may change it
+  inline std::atomic<int> &_num_threads()
+  {
+    static std::atomic<int> n = 0;
+    return n;
+  }
+
+  inline void set_num_threads(int n) { _num_threads().store(std::max(n, 0), std::memory_order_relaxed); }
+
+  inline int get_num_threads()
+  {
+    int n = _num_threads().load(std::memory_order_relaxed);
+    if (n > 0)
+      return n;
+    n = std::thread::hardware_concurrency();
+    return std::max(n, 1);
+  }
+
+  // number of chunks parallel_for_chunks will hand out for a range, use it to
+  // size per thread scratch (histograms, pair buffers...) and pass the same value
+  // to parallel_for_chunks, the thread count can change between two reads
+  inline int num_chunks(int N, int grain = 4096)
+  {
+    if (N <= 0)
+      return 1;
+    return std::max(1, std::min(get_num_threads(), (N + grain - 1) / grain));
+  }
+
+  // splits [begin, end) into at most n_chunks contiguous chunks and calls
+  // f(chunk_id, chunk_begin, chunk_end) with chunk_id < n_chunks, the calling
+  // thread takes chunk 0
+  template <typename F>
+  void parallel_for_chunks(int begin, int end, int n_chunks, F &&f)
+  {
+    int N = end - begin;
+    if (N <= 0)
+      return;
+
+    n_chunks = std::clamp(n_chunks, 1, N);
+    if (n_chunks == 1)
+    {
+      f(0, begin, end);
+      return;
+    }
+
+    int chunk = (N + n_chunks - 1) / n_chunks;
+    std::vector<std::thread> threads;
+    threads.reserve(n_chunks - 1);
+    for (int t = 1; t < n_chunks; t++)
+    {
+      int b = begin + t * chunk;
+      int e = std::min(b + chunk, end);
+      if (b >= e)
+        break;
+      threads.emplace_back([&f, t, b, e]()
+                           { f(t, b, e); });
+    }
+
+    f(0, begin, std::min(begin + chunk, end));
+    for (auto &th : threads)
+      th.join();
+  }
+
+  // one chunk per thread, ranges smaller than grain stay on the calling thread so
+  // tiny trees don't pay for thread startup
+  template <typename F>
+  void parallel_for_chunks(int begin, int end, F &&f, int grain = 4096)
+  {
+    parallel_for_chunks(begin, end, num_chunks(end - begin, grain), std::forward<F>(f));
+  }
+
+  // calls f(i) for every i in [begin, end)
+  template <typename F>
+  void parallel_for(int begin, int end, F &&f, int grain = 4096)
+  {
+    parallel_for_chunks(
+        begin, end, [&f](int, int b, int e)
+        {
+          for (int i = b; i < e; i++)
+            f(i); },
+        grain);
+  }
+
+  // fork join tasks for recursive work that doesn't split into even ranges, like top
+  // down tree builds. every worker owns a deque, it pushes and pops its own tasks at
+  // the back so it stays depth first on warm data, and when it runs dry it steals the
+  // oldest task from the front of another worker's deque, which is the biggest piece
+  // of work that worker has left. tasks get the index of the worker running them so
+  // they can spawn onto its deque
+  class task_scheduler
+  {
+  public:
+    typedef std::function<void(int worker)> task;
+
+    task_scheduler(int n_threads = get_num_threads()) : _queues(std::max(n_threads, 1)) {}
+
+    int size() const { return _queues.size(); }
+
+    // queues t on the worker's own deque, call it from inside a running task
+    void spawn(int worker, task t)
+    {
+      _pending.fetch_add(1, std::memory_order_relaxed);
+      std::lock_guard<std::mutex> lock(_queues[worker].mutex);
+      _queues[worker].tasks.push_back(std::move(t));
+    }
+
+    // runs root on the calling thread as worker 0 and returns once root and every
+    // task spawned from it have finished
+    void run(task root)
+    {
+      _pending.store(1, std::memory_order_relaxed);
+      _queues[0].tasks.push_back(std::move(root));
+      std::vector<std::thread> threads;
+      threads.reserve(size() - 1);
+      for (int w = 1; w < size(); w++)
+        threads.emplace_back([this, w]()
+                             { _work(w); });
+      _work(0);
+      for (auto &th : threads)
+        th.join();
+    }
+
+  protected:
+    struct queue
+    {
+      std::mutex mutex;
+      std::deque<task> tasks;
+    };
+
+    bool _pop(int w, task &t)
+    {
+      std::lock_guard<std::mutex> lock(_queues[w].mutex);
+      if (_queues[w].tasks.empty())
+        return false;
+      t = std::move(_queues[w].tasks.back());
+      _queues[w].tasks.pop_back();
+      return true;
+    }
+
+    bool _steal(int w, task &t)
+    {
+      for (int k = 1; k < size(); k++)
+      {
+        queue &q = _queues[(w + k) % size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+          continue;
+        t = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+      return false;
+    }
+
+    // a task's children are counted before the task itself is, so pending only
+    // reaches zero once all the work is done
+    void _work(int w)
+    {
+      task t;
+      while (_pending.load(std::memory_order_acquire) > 0)
+      {
+        if (_pop(w, t) || _steal(w, t))
+        {
+          t(w);
+          _pending.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        else
+          std::this_thread::yield();
+      }
+    }
+
+    std::vector<queue> _queues;
+    std::atomic<int> _pending = 0;
+  };
+
+} // mondrian
+
+#endif
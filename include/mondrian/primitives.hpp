@@ -0,0 +1,345 @@
+#ifndef __MONDIAN_PRIMITIVES__
+#define __MONDIAN_PRIMITIVES__
+
+#include <concepts>
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "binned_sah.hpp"
+
+namespace mondrian
+{
+  // primitives closest_point can run on, the point on primitive i closest to q
+  template <typename P>
+  concept distance_primitives = primitive_set<P> && requires(const P &prims, int i, const typename P::vec &q) {
+    { prims.closest_point(i, q) } -> std::same_as<typename P::vec>;
+  };
+
+  // primitives intersect_closest can run on, fills hit when primitive i is hit inside
+  // (0, tmax)
+  template <typename P>
+  concept ray_primitives = primitive_set<P> && requires(const P &prims, int i, const watertight_ray &r, real tmax, ray_hit &hit) {
+    { prims.intersect(i, r, tmax, hit) } -> std::same_as<bool>;
+  };
+
+  // closest point on a primitive set, in the precision of the set
+  template <typename T>
+  struct primitive_hit
+  {
+    int prim = -1;
+    glm::vec<3, T> p = glm::vec<3, T>(0.0);
+    T d2 = std::numeric_limits<T>::max();
+
+    bool hit() const { return prim >= 0; }
+    T distance() const { return std::sqrt(d2); }
+  };
+
+  namespace detail
+  {
+    // squared distance from p to the box, in the precision of p so pruning against
+    // a double answer doesn't drop nodes on float rounding
+    template <typename T>
+    inline T distance2(const extents_3 &e, const glm::vec<3, T> &p)
+    {
+      T d2 = 0.0;
+      for (int k = 0; k < 3; k++)
+      {
+        T d = std::max(std::max(T(e[0][k]) - p[k], p[k] - T(e[1][k])), T(0));
+        d2 += d * d;
+      }
+      return d2;
+    }
+  } // namespace detail
+
+  // closest point to p on the triangle abc by the voronoi regions of its vertices,
+  // edges and face, Ericson's Real-Time Collision Detection 5.1.5. V is any glm vec3,
+  // the primitive sets run it in double as well
+  template <typename V, typename T = typename V::value_type>
+  inline V closest_point_triangle(const V &p, const V &a, const V &b, const V &c, T &u, T &v, T &w)
+  {
+    V ab = b - a, ac = c - a, ap = p - a;
+    T d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f)
+    {
+      u = 1.0, v = 0.0, w = 0.0;
+      return a;
+    }
+
+    V bp = p - b;
+    T d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3)
+    {
+      u = 0.0, v = 1.0, w = 0.0;
+      return b;
+    }
+
+    T vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    {
+      T t = d1 / (d1 - d3);
+      u = T(1) - t, v = t, w = 0.0;
+      return a + t * ab;
+    }
+
+    V cp = p - c;
+    T d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6)
+    {
+      u = 0.0, v = 0.0, w = 1.0;
+      return c;
+    }
+
+    T vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    {
+      T t = d2 / (d2 - d6);
+      u = T(1) - t, v = 0.0, w = t;
+      return a + t * ac;
+    }
+
+    T va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+    {
+      T t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+      u = 0.0, v = T(1) - t, w = t;
+      return b + t * (c - b);
+    }
+
+    // inside the face, a degenerate triangle ends up in one of the edge cases above
+    T denom = T(1) / (va + vb + vc);
+    v = vb * denom;
+    w = vc * denom;
+    u = T(1) - v - w;
+    return a + v * ab + w * ac;
+  }
+
+  // points stored directly, no index array to go through. a view like simplex_set
+  template <typename T = real>
+  struct point_set
+  {
+    using scalar = T;
+    using vec = glm::vec<3, T>;
+
+    std::span<const vec> x;
+
+    point_set() = default;
+    point_set(std::span<const vec> x) : x(x) {}
+
+    int size() const { return x.size(); }
+
+    extents_3 bounds(int i) const
+    {
+      const vec &p = x[i];
+      return {vec3(detail::round_down(p[0]), detail::round_down(p[1]), detail::round_down(p[2])),
+              vec3(detail::round_up(p[0]), detail::round_up(p[1]), detail::round_up(p[2]))};
+    }
+
+    vec3 centroid(int i) const { return vec3(x[i]); }
+    vec closest_point(int i, const vec &) const { return x[i]; }
+  };
+
+  // line segments, polylines, curves and hair
+  template <typename T = real>
+  struct segment_set : simplex_set<T, 2>
+  {
+    using typename simplex_set<T, 2>::vec;
+    using simplex_set<T, 2>::simplex_set;
+    using simplex_set<T, 2>::vertex;
+
+    vec closest_point(int i, const vec &q) const
+    {
+      const vec &a = vertex(i, 0), &b = vertex(i, 1);
+      vec ab = b - a;
+      T l2 = glm::dot(ab, ab);
+      T t = l2 > T(0) ? std::clamp(glm::dot(q - a, ab) / l2, T(0), T(1)) : T(0);
+      return a + t * ab;
+    }
+  };
+
+  // triangle soups and surface meshes. ray queries go through the watertight test,
+  // which runs in real, so only the real precision set takes rays
+  template <typename T = real>
+  struct triangle_set : simplex_set<T, 3>
+  {
+    using typename simplex_set<T, 3>::vec;
+    using simplex_set<T, 3>::simplex_set;
+    using simplex_set<T, 3>::vertex;
+
+    vec closest_point(int i, const vec &q) const
+    {
+      T u, v, w;
+      return closest_point_triangle(q, vertex(i, 0), vertex(i, 1), vertex(i, 2), u, v, w);
+    }
+
+    bool intersect(int i, const watertight_ray &r, real tmax, ray_hit &hit) const
+      requires std::same_as<T, real>
+    {
+      return intersect_triangle(r, vertex(i, 0), vertex(i, 1), vertex(i, 2), tmax, hit);
+    }
+  };
+
+  // tetrahedral volume meshes, a point inside a tet is its own closest point
+  template <typename T = real>
+  struct tet_set : simplex_set<T, 4>
+  {
+    using typename simplex_set<T, 4>::vec;
+    using simplex_set<T, 4>::simplex_set;
+    using simplex_set<T, 4>::vertex;
+
+    // inside or on the boundary, q is on the same side of every face as the opposite
+    // vertex. works for either orientation of the tet. a flat tet has the opposite
+    // vertex on a face plane and no inside, every q would pass that face, so it
+    // contains nothing and its distance comes from the faces
+    bool contains(int i, const vec &q) const
+    {
+      const int faces[4][4] = {{1, 2, 3, 0}, {0, 3, 2, 1}, {0, 1, 3, 2}, {0, 2, 1, 3}};
+      for (const auto &f : faces)
+      {
+        const vec &a = vertex(i, f[0]);
+        vec n = glm::cross(vertex(i, f[1]) - a, vertex(i, f[2]) - a);
+        T side = glm::dot(n, q - a), opposite = glm::dot(n, vertex(i, f[3]) - a);
+        if (opposite == T(0) || side * opposite < T(0))
+          return false;
+      }
+      return true;
+    }
+
+    vec closest_point(int i, const vec &q) const
+    {
+      if (contains(i, q))
+        return q;
+      const int faces[4][3] = {{1, 2, 3}, {0, 3, 2}, {0, 1, 3}, {0, 2, 1}};
+      vec best = vertex(i, 0);
+      T best_d2 = std::numeric_limits<T>::max();
+      for (const auto &f : faces)
+      {
+        T u, v, w;
+        vec p = closest_point_triangle(q, vertex(i, f[0]), vertex(i, f[1]), vertex(i, f[2]), u, v, w);
+        T d2 = glm::dot(p - q, p - q);
+        if (d2 < best_d2)
+          best = p, best_d2 = d2;
+      }
+      return best;
+    }
+  };
+
+  static_assert(distance_primitives<point_set<float>> && distance_primitives<point_set<double>>);
+  static_assert(distance_primitives<segment_set<float>> && distance_primitives<segment_set<double>>);
+  static_assert(ray_primitives<triangle_set<real>> && distance_primitives<triangle_set<double>>);
+  static_assert(!ray_primitives<triangle_set<double>>, "rays only run in real precision");
+  static_assert(distance_primitives<tet_set<float>> && distance_primitives<tet_set<double>>);
+
+  namespace detail
+  {
+    // closest_point with the traversal stack handed in, so batches reuse one
+    template <distance_primitives P>
+    primitive_hit<typename P::scalar> closest_point(aabb_tree_view tree, const P &prims, const typename P::vec &p,
+                                                    typename P::scalar max_dist, int hint,
+                                                    std::vector<std::pair<typename P::scalar, uint>> &stack)
+    {
+      using T = typename P::scalar;
+      primitive_hit<T> best;
+      if (tree.size() == 0)
+        return best;
+      best.d2 = max_dist < std::numeric_limits<T>::max() ? max_dist * max_dist : max_dist;
+      auto test = [&](int prim)
+      {
+        typename P::vec q = prims.closest_point(prim, p);
+        T d2 = glm::dot(q - p, q - p);
+        if (d2 <= best.d2)
+          best = {prim, q, d2};
+      };
+      if (hint >= 0 && hint < tree.size())
+        test(hint);
+
+      uint leaf_start = tree.leaf_start();
+      stack.clear();
+      stack.push_back({distance2(tree.extents[0], p), 0});
+      while (stack.size() > 0)
+      {
+        auto [d2, i] = stack.back();
+        stack.pop_back();
+        if (d2 > best.d2)
+          continue;
+        if (is_leaf(i, leaf_start))
+        {
+          test(tree.ids[i - leaf_start]);
+          continue;
+        }
+        uint l = left_child(tree.nodes[i], leaf_start);
+        uint r = right_child(tree.nodes[i], leaf_start);
+        T dl = distance2(tree.extents[l], p);
+        T dr = distance2(tree.extents[r], p);
+        // push the far child first so the near one is popped next
+        if (dl < dr)
+          std::swap(l, r), std::swap(dl, dr);
+        if (dl <= best.d2)
+          stack.push_back({dl, l});
+        if (dr <= best.d2)
+          stack.push_back({dr, r});
+      }
+      return best;
+    }
+  } // namespace detail
+
+  // closest primitive to p within max_dist, branch and bound over the binary tree:
+  // nodes farther than the best so far are pruned and the nearer child is visited
+  // first. hint is a primitive likely to be close, it only sets the starting bound
+  template <distance_primitives P>
+  primitive_hit<typename P::scalar> closest_point(aabb_tree_view tree, const P &prims, const typename P::vec &p,
+                                                  typename P::scalar max_dist = std::numeric_limits<typename P::scalar>::max(),
+                                                  int hint = -1)
+  {
+    std::vector<std::pair<typename P::scalar, uint>> stack;
+    return detail::closest_point(tree, prims, p, max_dist, hint, stack);
+  }
+
+  // nearest primitive along the ray, nearer child first and boxes beyond the closest
+  // hit so far skipped
+  template <ray_primitives P>
+  ray_hit intersect_closest(aabb_tree_view tree, const P &prims, const ray_t &r, real tmax = ray_tmax)
+  {
+    ray_hit best;
+    best.t = tmax;
+    real tnear;
+    if (tree.size() == 0 || !ray_box(r, tree.extents[0], 0.0f, tmax, tnear))
+      return best;
+
+    watertight_ray wr(r);
+    uint leaf_start = tree.leaf_start();
+    std::vector<std::pair<real, uint>> stack = {{tnear, 0}};
+    while (stack.size() > 0)
+    {
+      auto [t, i] = stack.back();
+      stack.pop_back();
+      if (t > best.t)
+        continue;
+      if (is_leaf(i, leaf_start))
+      {
+        int prim = tree.ids[i - leaf_start];
+        ray_hit hit;
+        if (prims.intersect(prim, wr, best.t, hit))
+        {
+          hit.prim = prim;
+          best = hit;
+        }
+        continue;
+      }
+      uint l = left_child(tree.nodes[i], leaf_start);
+      uint c = right_child(tree.nodes[i], leaf_start);
+      real tl, tr;
+      bool hl = ray_box(r, tree.extents[l], 0.0f, best.t, tl);
+      bool hr = ray_box(r, tree.extents[c], 0.0f, best.t, tr);
+      if (hl && hr && tl < tr)
+        std::swap(l, c), std::swap(tl, tr), std::swap(hl, hr);
+      if (hl)
+        stack.push_back({tl, l});
+      if (hr)
+        stack.push_back({tr, c});
+    }
+    return best;
+  }
+
+} // mondrian
+
+#endif
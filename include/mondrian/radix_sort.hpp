@@ -0,0 +1,99 @@
+#ifndef __MONDIAN_RADIX_SORT__
+#define __MONDIAN_RADIX_SORT__
+
+#include <array>
+#include <vector>
+#include <type_traits>
+
+#include "parallel.hpp"
+
+namespace mondrian
+{
+  // stable LSD radix sort of (key, value) pairs on the key, 8 bits per pass.
+  // keys are treated as unsigned, so signed keys must be non negative (morton codes are).
+  // each pass builds one histogram per chunk, prefix sums them in (digit, chunk) order
+  // and then every chunk scatters into its own disjoint slots, so no atomics are needed.
+  // passes above the highest set bit, or where every key shares the digit, are skipped.
+  template <typename K, typename V>
+  void radix_sort_pairs(std::vector<K> &keys, std::vector<V> &vals, int grain = 1 << 14)
+  {
+    using U = std::make_unsigned_t<K>;
+    const int RADIX_BITS = 8;
+    const int RADIX = 1 << RADIX_BITS;
+    const int N = keys.size();
+    if (N < 2)
+      return;
+
+    const int n_chunks = num_chunks(N, grain);
+    const int chunk = (N + n_chunks - 1) / n_chunks;
+
+    std::vector<U> mask_chunk(n_chunks, 0);
+    parallel_for(0, n_chunks, [&](int t)
+                 {
+      int b = t * chunk, e = std::min(b + chunk, N);
+      U m = 0;
+      for (int i = b; i < e; i++)
+        m |= U(keys[i]);
+      mask_chunk[t] = m; },
+                 1);
+    U mask = 0;
+    for (U m : mask_chunk)
+      mask |= m;
+
+    std::vector<K> keys_tmp(N);
+    std::vector<V> vals_tmp(N);
+    std::vector<std::array<int, RADIX>> hist(n_chunks);
+
+    for (int shift = 0; shift < int(sizeof(U) * 8); shift += RADIX_BITS)
+    {
+      if ((mask >> shift) == 0)
+        break;
+
+      parallel_for(0, n_chunks, [&](int t)
+                   {
+        int b = t * chunk, e = std::min(b + chunk, N);
+        std::array<int, RADIX> &h = hist[t];
+        h.fill(0);
+        for (int i = b; i < e; i++)
+          h[(U(keys[i]) >> shift) & (RADIX - 1)]++; },
+                   1);
+
+      // exclusive scan over digits first, then chunks, keeps the sort stable
+      int sum = 0;
+      bool trivial = false;
+      for (int d = 0; d < RADIX; d++)
+      {
+        int count = 0;
+        for (int t = 0; t < n_chunks; t++)
+        {
+          int c = hist[t][d];
+          hist[t][d] = sum;
+          sum += c;
+          count += c;
+        }
+        if (count == N)
+          trivial = true;
+      }
+      if (trivial)
+        continue;
+
+      parallel_for(0, n_chunks, [&](int t)
+                   {
+        int b = t * chunk, e = std::min(b + chunk, N);
+        std::array<int, RADIX> &offset = hist[t];
+        for (int i = b; i < e; i++)
+        {
+          int j = offset[(U(keys[i]) >> shift) & (RADIX - 1)]++;
+          keys_tmp[j] = keys[i];
+          vals_tmp[j] = vals[i];
+        } },
+                   1);
+
+      keys.swap(keys_tmp);
+      vals.swap(vals_tmp);
+    }
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef __MONDIAN_RAY__
+#define __MONDIAN_RAY__
+
+#include <span>
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // the inverse direction is computed once per ray for the slab tests,
+  // a zero component turns into +-inf which the slab test handles
+  struct ray_t
+  {
+    ray_t() = default;
+    ray_t(const vec3 &o, const vec3 &d) : o(o), d(d), inv_d(1.0f / d[0], 1.0f / d[1], 1.0f / d[2]) {}
+
+    vec3 o = vec3(0.0);
+    vec3 d = vec3(0.0, 0.0, 1.0);
+    vec3 inv_d = vec3(ext::inf_t, ext::inf_t, 1.0);
+  };
+
+  // largest t a query starts from, kept finite so empty or degenerate boxes can't
+  // produce an inf <= inf hit
+  const real ray_tmax = std::numeric_limits<real>::max();
+
+  // slab test, returns the entry distance in tnear when the ray hits e inside [tmin, tmax]
+  inline bool ray_box(const ray_t &r, const ext::extents_t &e, real tmin, real tmax, real &tnear)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      real t0 = (e[0][k] - r.o[k]) * r.inv_d[k];
+      real t1 = (e[1][k] - r.o[k]) * r.inv_d[k];
+      tmin = std::max(tmin, std::min(t0, t1));
+      tmax = std::min(tmax, std::max(t0, t1));
+    }
+    tnear = tmin;
+    return tmin <= tmax;
+  }
+
+  // sort key of a ray, the direction octant on top of a 27 bit morton code of the origin
+  // inside the box at mn, rays starting close together and heading the same way get
+  // nearby keys and tend to visit the same nodes
+  inline uint ray_key(const ray_t &r, const vec3 &mn, const vec3 &inv_extent)
+  {
+    vec3 c = (r.o - mn) * inv_extent;
+    uint octant = uint(r.d[0] < 0.0f) | uint(r.d[1] < 0.0f) << 1 | uint(r.d[2] < 0.0f) << 2;
+    return octant << 27 | packVec3(c[0], c[1], c[2]) >> 3;
+  }
+
+  // order that groups coherent rays, rays[order[0]], rays[order[1]] ...
+  std::vector<int> sort_rays(std::span<const ray_t> rays)
+  {
+    int N = rays.size();
+    std::vector<int> order(N);
+    for (int i = 0; i < N; i++)
+      order[i] = i;
+    if (N < 2)
+      return order;
+
+    vec3 mn = rays[0].o, mx = rays[0].o;
+    for (int i = 0; i < N; i++)
+    {
+      mn = min(mn, rays[i].o);
+      mx = max(mx, rays[i].o);
+    }
+    vec3 d = mx - mn;
+    vec3 inv_extent(d[0] > 0.0f ? 1.0f / d[0] : 0.0f,
+                    d[1] > 0.0f ? 1.0f / d[1] : 0.0f,
+                    d[2] > 0.0f ? 1.0f / d[2] : 0.0f);
+
+    std::vector<uint> keys(N);
+    parallel_for(0, N, [&](int i)
+                 { keys[i] = ray_key(rays[i], mn, inv_extent); });
+    radix_sort_pairs(keys, order);
+    return order;
+  }
+
+  // closest hit along a ray, prim is -1 on a miss. u, v, w are the barycentric
+  // weights of the triangle's first, second and third vertex
+  struct ray_hit
+  {
+    int prim = -1;
+    real t = ray_tmax;
+    real u = 0.0, v = 0.0, w = 0.0;
+
+    bool hit() const { return prim >= 0; }
+  };
+
+  // per ray setup of the watertight test, the ray is sheared so it points down +z
+  // and triangles are tested in 2d, see Woop, Benthin and Wald 2013
+  struct watertight_ray
+  {
+    watertight_ray() = default;
+    watertight_ray(const ray_t &r) : o(r.o)
+    {
+      vec3 ad = abs(r.d);
+      kz = ad[0] > ad[1] ? (ad[0] > ad[2] ? 0 : 2) : (ad[1] > ad[2] ? 1 : 2);
+      kx = (kz + 1) % 3;
+      ky = (kx + 1) % 3;
+      // keep the winding when the dominant axis points backwards
+      if (r.d[kz] < 0.0f)
+        std::swap(kx, ky);
+      Sx = r.d[kx] / r.d[kz];
+      Sy = r.d[ky] / r.d[kz];
+      Sz = 1.0f / r.d[kz];
+    }
+
+    vec3 o;
+    int kx, ky, kz;
+    real Sx, Sy, Sz;
+  };
+
+  // watertight ray triangle test, a ray through an edge or vertex shared by several
+  // triangles never slips through the crack between them (it may report more than one).
+  // fills t and the barycentrics of hit when the triangle is hit inside (0, tmax)
+  inline bool intersect_triangle(const watertight_ray &r, const vec3 &a, const vec3 &b, const vec3 &c,
+                                 real tmax, ray_hit &hit)
+  {
+    const vec3 A = a - r.o, B = b - r.o, C = c - r.o;
+    const real Ax = A[r.kx] - r.Sx * A[r.kz], Ay = A[r.ky] - r.Sy * A[r.kz];
+    const real Bx = B[r.kx] - r.Sx * B[r.kz], By = B[r.ky] - r.Sy * B[r.kz];
+    const real Cx = C[r.kx] - r.Sx * C[r.kz], Cy = C[r.ky] - r.Sy * C[r.kz];
+
+    real U = Cx * By - Cy * Bx;
+    real V = Ax * Cy - Ay * Cx;
+    real W = Bx * Ay - By * Ax;
+
+    // exactly on an edge in float, redo the edge functions in double to break the tie
+    if (U == 0.0f || V == 0.0f || W == 0.0f)
+    {
+      U = real(double(Cx) * double(By) - double(Cy) * double(Bx));
+      V = real(double(Ax) * double(Cy) - double(Ay) * double(Cx));
+      W = real(double(Bx) * double(Ay) - double(By) * double(Ax));
+    }
+
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+      return false;
+
+    real det = U + V + W;
+    if (det == 0.0f)
+      return false;
+
+    const real Az = r.Sz * A[r.kz], Bz = r.Sz * B[r.kz], Cz = r.Sz * C[r.kz];
+    const real T = U * Az + V * Bz + W * Cz;
+
+    // compare t against (0, tmax) before dividing, both sides scaled by det
+    real sign = det < 0.0f ? -1.0f : 1.0f;
+    if (T * sign <= 0.0f || T * sign > tmax * det * sign)
+      return false;
+
+    real inv_det = 1.0f / det;
+    hit.t = T * inv_det;
+    hit.u = U * inv_det;
+    hit.v = V * inv_det;
+    hit.w = W * inv_det;
+    return true;
+  }
+
+} // mondrian
+
+#endif
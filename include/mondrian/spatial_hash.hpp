@@ -0,0 +1,167 @@
+#ifndef __MONDIAN_SPATIAL_HASH__
+#define __MONDIAN_SPATIAL_HASH__
+
+#include "aabb.hpp"
+#include "neighbors.hpp"
+
+namespace mondrian
+{
+  // cell linked list over a point cloud, the radix binning alternative to the tree for
+  // uniform density data (SPH). the bounding cube is split into res^3 cells with res a
+  // power of two, cells are quantized with scale() like packVec3 and keyed by their
+  // morton code so neighboring cells stay close in memory. points are counting sorted
+  // by cell and offsets[key] ... offsets[key + 1] is the range of a cell in ids / points
+  class spatial_hash
+  {
+  public:
+    typedef std::shared_ptr<spatial_hash> ptr;
+
+    static ptr create(const std::vector<vec3> &x, real cell_size)
+    {
+      return std::make_shared<spatial_hash>(x, cell_size);
+    }
+
+    spatial_hash(const std::vector<vec3> &x, real cell_size)
+    {
+      build(x, cell_size);
+    }
+
+    // cells are the largest power of two fraction of the bounding cube no bigger than
+    // cell_size, capped at packVec3's 1024 per axis and at about 8 cells per point
+    void build(const std::vector<vec3> &x, real cell_size)
+    {
+      int N = x.size();
+      _res = 1;
+      _bits = 0;
+      _ids.clear();
+      _points.clear();
+      _ranks.clear();
+      _offsets.assign(2, 0);
+      if (N == 0)
+        return;
+
+      vec3 mn = x[0], mx = x[0];
+      for (int i = 0; i < N; i++)
+      {
+        mn = min(mn, x[i]);
+        mx = max(mx, x[i]);
+      }
+      vec3 d = mx - mn;
+      real extent = std::max(std::max(d[0], d[1]), d[2]);
+      extent = extent > 0.0 ? extent : 1.0;
+
+      while (_bits < 10 && extent / real(_res) > cell_size &&
+             uint64_t(_res * 2) * (_res * 2) * (_res * 2) <= 8 * uint64_t(N))
+      {
+        _res *= 2;
+        _bits++;
+      }
+      _origin = mn;
+      _inv_extent = 1.0 / extent;
+      _cell_size = extent / real(_res);
+
+      std::vector<uint> keys(N);
+      parallel_for(0, N, [&](int i)
+                   { keys[i] = cell_key(x[i]); });
+
+      // counting sort, histogram, exclusive prefix and a stable scatter
+      uint n_cells = 1u << (3 * _bits);
+      _offsets.assign(n_cells + 1, 0);
+      for (int i = 0; i < N; i++)
+        _offsets[keys[i] + 1]++;
+      for (uint c = 0; c < n_cells; c++)
+        _offsets[c + 1] += _offsets[c];
+
+      std::vector<int> cursor(_offsets.begin(), _offsets.end() - 1);
+      _ids.resize(N);
+      for (int i = 0; i < N; i++)
+        _ids[cursor[keys[i]]++] = i;
+
+      _points.resize(N);
+      _ranks.resize(N);
+      parallel_for(0, N, [&](int j)
+                   {
+        _points[j] = x[_ids[j]];
+        _ranks[_ids[j]] = j; });
+    }
+
+    // integer cell of p along each axis, clamped to the grid
+    std::array<uint, 3> cell_coord(const vec3 &p) const
+    {
+      vec3 c = (p - _origin) * _inv_extent;
+      return {uint(scale(c[0], real(_res))), uint(scale(c[1], real(_res))), uint(scale(c[2], real(_res)))};
+    }
+
+    // morton code of the cell at (ix, iy, iz), same interleave as packVec3
+    uint cell_key(uint ix, uint iy, uint iz) const
+    {
+      return expandBits(ix) * 4 + expandBits(iy) * 2 + expandBits(iz);
+    }
+
+    uint cell_key(const vec3 &p) const
+    {
+      std::array<uint, 3> c = cell_coord(p);
+      return cell_key(c[0], c[1], c[2]);
+    }
+
+    // calls f(j) for every sorted position j in the cells overlapping the box [lo, hi]
+    template <typename F>
+    void for_each_in_cells(const vec3 &lo, const vec3 &hi, F &&f) const
+    {
+      if (_ids.empty())
+        return;
+      std::array<uint, 3> a = cell_coord(lo), b = cell_coord(hi);
+      for (uint ix = a[0]; ix <= b[0]; ix++)
+        for (uint iy = a[1]; iy <= b[1]; iy++)
+          for (uint iz = a[2]; iz <= b[2]; iz++)
+          {
+            uint key = cell_key(ix, iy, iz);
+            for (int j = _offsets[key]; j < _offsets[key + 1]; j++)
+              f(j);
+          }
+    }
+
+    // appends every point within r of p to out, skipping exclude
+    void radius_query(const vec3 &p, real r, std::vector<int> &out, int exclude = -1) const
+    {
+      real r2 = r * r;
+      vec3 vr(r, r, r);
+      for_each_in_cells(p - vr, p + vr, [&](int j)
+                        {
+        vec3 d = _points[j] - p;
+        if (_ids[j] != exclude && glm::dot(d, d) <= r2)
+          out.push_back(_ids[j]); });
+    }
+
+    // fixed radius neighbors of every point, a point is not its own neighbor. points are
+    // visited cell by cell so consecutive queries read the same cells
+    neighbor_lists radius_query_all(real r) const
+    {
+      return detail::build_neighbor_lists(_ids, [&](int id, std::vector<int> &row)
+                                          { radius_query(_points[_ranks[id]], r, row, id); });
+    }
+
+    int size() const { return _ids.size(); }
+    int resolution() const { return _res; }
+    real cell_size() const { return _cell_size; }
+    int cell_begin(uint key) const { return _offsets[key]; }
+    int cell_end(uint key) const { return _offsets[key + 1]; }
+    const std::vector<int> &offsets() const { return _offsets; }
+    const std::vector<int> &ids() const { return _ids; }
+    const std::vector<vec3> &points() const { return _points; }
+
+  protected:
+    int _res = 1;
+    int _bits = 0;
+    vec3 _origin = vec3(0.0);
+    real _inv_extent = 1.0;
+    real _cell_size = 1.0;
+    std::vector<int> _offsets;
+    std::vector<int> _ids;
+    std::vector<vec3> _points;
+    std::vector<int> _ranks; // sorted position of every point
+  };
+
+} // mondrian
+
+#endif
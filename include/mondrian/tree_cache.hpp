@@ -0,0 +1,274 @@
+#ifndef __MONDIAN_TREE_CACHE__
+#define __MONDIAN_TREE_CACHE__
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // binary layout of a saved tree, a header followed by the nodes, extents and ids
+  // arrays each starting on a 64 byte boundary so they can be used straight from the
+  // mapping. the sizes of the element types are stored to catch builds with a
+  // different layout, bump tree_file_version whenever the layout or builder changes
+  const char tree_file_magic[8] = {'M', 'O', 'N', 'D', 'B', 'V', 'H', '\0'};
+  const uint32_t tree_file_version = 2;
+
+  struct tree_file_header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint32_t extents_size;
+    uint32_t id_size;
+    uint64_t geometry_hash;
+    uint64_t n_nodes;
+    uint64_t n_ids;
+    uint64_t nodes_offset;
+    uint64_t extents_offset;
+    uint64_t ids_offset;
+    uint64_t file_size;
+  };
+
+  static_assert(std::is_trivially_copyable_v<radix_tree_node>, "radix_tree_node is written as raw bytes");
+  static_assert(std::is_trivially_copyable_v<extents_3>, "extents_3 is written as raw bytes");
+
+  namespace detail
+  {
+    // xxhash64 style rounds over 64 bit words, a cache key, not a checksum. the
+    // multiply then rotate moves the high bits of every word back down, a plain xor
+    // multiply chain never does and differences in the top bit cancel out in pairs
+    inline uint64_t hash_round(uint64_t h, uint64_t w)
+    {
+      h += w * 0xc2b2ae3d27d4eb4full;
+      h = (h << 31) | (h >> 33);
+      return h * 0x9e3779b185ebca87ull;
+    }
+
+    inline uint64_t hash_words(const void *data, size_t n, uint64_t h = 0x27d4eb2f165667c5ull)
+    {
+      const unsigned char *p = (const unsigned char *)data;
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = hash_round(h, w);
+      }
+      // the tail is zero padded and the length mixed in so padding can't collide
+      uint64_t w = 0;
+      if (i < n)
+        std::memcpy(&w, p + i, n - i);
+      h = hash_round(hash_round(h, w), n);
+      // final avalanche
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ull;
+      return h ^ (h >> 33);
+    }
+
+    inline uint64_t align_64(uint64_t offset) { return (offset + 63) & ~uint64_t(63); }
+  } // namespace detail
+
+  // cache key of a mesh, any change to the connectivity, the vertices or the primitive
+  // stride gives a different hash
+  template <int STRIDE>
+  uint64_t hash_geometry(const std::vector<int> &indices, const std::vector<vec3> &x)
+  {
+    int stride = STRIDE;
+    uint64_t h = detail::hash_words(&stride, sizeof(int));
+    h = detail::hash_words(indices.data(), indices.size() * sizeof(int), h);
+    h = detail::hash_words(x.data(), x.size() * sizeof(vec3), h);
+    return h;
+  }
+
+  // writes the tree next to its geometry hash, returns false when the file can't be written
+  bool save_tree(const std::string &path, aabb_tree_view tree, uint64_t geometry_hash)
+  {
+    tree_file_header header = {};
+    std::memcpy(header.magic, tree_file_magic, sizeof(header.magic));
+    header.version = tree_file_version;
+    header.node_size = sizeof(radix_tree_node);
+    header.extents_size = sizeof(extents_3);
+    header.id_size = sizeof(int);
+    header.geometry_hash = geometry_hash;
+    header.n_nodes = tree.nodes.size();
+    header.n_ids = tree.ids.size();
+    header.nodes_offset = detail::align_64(sizeof(tree_file_header));
+    header.extents_offset = detail::align_64(header.nodes_offset + header.n_nodes * sizeof(radix_tree_node));
+    header.ids_offset = detail::align_64(header.extents_offset + header.n_nodes * sizeof(extents_3));
+    header.file_size = header.ids_offset + header.n_ids * sizeof(int);
+
+    // write to a temporary and rename so a crash never leaves a truncated cache behind
+    std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f)
+      return false;
+    // sections are written in order, zero padded up to their offsets
+    bool ok = true;
+    uint64_t at = 0;
+    auto write_at = [&](uint64_t offset, const void *data, size_t n)
+    {
+      static const char zeros[64] = {};
+      if (ok && offset > at)
+        ok = std::fwrite(zeros, 1, offset - at, f) == offset - at;
+      if (ok && n > 0)
+        ok = std::fwrite(data, 1, n, f) == n;
+      at = offset + n;
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.nodes_offset, tree.nodes.data(), tree.nodes.size_bytes());
+    write_at(header.extents_offset, tree.extents.data(), tree.extents.size_bytes());
+    write_at(header.ids_offset, tree.ids.data(), tree.ids.size_bytes());
+    ok = std::fclose(f) == 0 && ok;
+#if defined(_WIN32)
+    // rename doesn't replace an existing file here
+    if (ok)
+      std::remove(path.c_str());
+#endif
+    if (ok)
+      ok = std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok)
+      std::remove(tmp.c_str());
+    return ok;
+  }
+
+  // a saved tree used in place, the file is mapped read only and the view points
+  // into the mapping so loading costs no copies, the pages come in as they are touched
+  class mapped_tree
+  {
+  public:
+    typedef std::shared_ptr<mapped_tree> ptr;
+
+    // nullptr when the file is missing, truncated, from another version or layout,
+    // or was built from different geometry
+    static ptr open(const std::string &path, uint64_t geometry_hash)
+    {
+      ptr tree = std::make_shared<mapped_tree>();
+      if (!tree->_map(path) || !tree->_validate(geometry_hash))
+        return nullptr;
+      return tree;
+    }
+
+    mapped_tree() = default;
+    mapped_tree(const mapped_tree &) = delete;
+    mapped_tree &operator=(const mapped_tree &) = delete;
+
+    ~mapped_tree()
+    {
+#if !defined(_WIN32)
+      if (_data)
+        munmap((void *)_data, _size);
+#endif
+    }
+
+    aabb_tree_view view() const { return _view; }
+    const tree_file_header &header() const { return *(const tree_file_header *)_data; }
+
+    // owning copy, for when the tree is going to be modified
+    aabb_tree copy() const
+    {
+      aabb_tree tree;
+      tree.nodes.assign(_view.nodes.begin(), _view.nodes.end());
+      tree.extents.assign(_view.extents.begin(), _view.extents.end());
+      tree.ids.assign(_view.ids.begin(), _view.ids.end());
+      return tree;
+    }
+
+  protected:
+    bool _map(const std::string &path)
+    {
+#if defined(_WIN32)
+      // no mmap, read the file into memory instead
+      std::ifstream in(path, std::ios::binary | std::ios::ate);
+      if (!in)
+        return false;
+      _size = in.tellg();
+      _buffer.resize((_size + 63) / 64);
+      in.seekg(0);
+      if (!in.read((char *)_buffer.data(), _size))
+        return false;
+      _data = (const char *)_buffer.data();
+#else
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size < off_t(sizeof(tree_file_header)))
+      {
+        ::close(fd);
+        return false;
+      }
+      _size = st.st_size;
+      void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (p == MAP_FAILED)
+        return false;
+      _data = (const char *)p;
+#endif
+      return _size >= sizeof(tree_file_header);
+    }
+
+    bool _validate(uint64_t geometry_hash)
+    {
+      const tree_file_header &h = header();
+      if (std::memcmp(h.magic, tree_file_magic, sizeof(h.magic)) != 0 || h.version != tree_file_version)
+        return false;
+      if (h.node_size != sizeof(radix_tree_node) || h.extents_size != sizeof(extents_3) || h.id_size != sizeof(int))
+        return false;
+      if (h.geometry_hash != geometry_hash || h.file_size != _size)
+        return false;
+      // a tree over N primitives has 2N - 1 nodes
+      if (h.n_ids > 0 && h.n_nodes != 2 * h.n_ids - 1)
+        return false;
+      if (h.nodes_offset % 64 || h.extents_offset % 64 || h.ids_offset % 64 ||
+          h.nodes_offset + h.n_nodes * sizeof(radix_tree_node) > h.extents_offset ||
+          h.extents_offset + h.n_nodes * sizeof(extents_3) > h.ids_offset ||
+          h.ids_offset + h.n_ids * sizeof(int) > _size)
+        return false;
+
+      _view = aabb_tree_view(
+          {(const radix_tree_node *)(_data + h.nodes_offset), size_t(h.n_nodes)},
+          {(const extents_3 *)(_data + h.extents_offset), size_t(h.n_nodes)},
+          {(const int *)(_data + h.ids_offset), size_t(h.n_ids)});
+      return true;
+    }
+
+    const char *_data = nullptr;
+    size_t _size = 0;
+    aabb_tree_view _view;
+#if defined(_WIN32)
+    std::vector<std::array<char, 64>> _buffer;
+#endif
+  };
+
+  // maps the cached tree at path when it matches the mesh, otherwise builds the tree,
+  // saves it to path and maps the new file. falls back to nullptr only when the cache
+  // can't be written
+  template <int STRIDE>
+  mapped_tree::ptr load_or_build_tree(const std::string &path, const std::vector<int> &indices,
+                                      const std::vector<vec3> &x)
+  {
+    uint64_t hash = hash_geometry<STRIDE>(indices, x);
+    if (mapped_tree::ptr cached = mapped_tree::open(path, hash))
+      return cached;
+    aabb_tree tree = build_aabb_tree<STRIDE>(indices, x);
+    if (!save_tree(path, tree, hash))
+      return nullptr;
+    return mapped_tree::open(path, hash);
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef __MONDIAN_TREELET__
+#define __MONDIAN_TREELET__
+
+#include "aabb.hpp"
+
+namespace mondrian
+{
+  // build time vs quality knobs for optimize_treelets. bigger treelets find better
+  // topologies but the search is exponential in their size, more rounds keep improving
+  // until the tree settles. min_subtree is doubled every round like in Karras 2013
+  struct treelet_settings
+  {
+    int max_leaves = 7; // clamped to [3, 7]
+    int iterations = 3;
+    int min_subtree = 7;
+  };
+
+  namespace detail
+  {
+    struct treelet_tree
+    {
+      uint leaf_start;
+      std::vector<uint2> children;
+      std::vector<uint> parent;
+      std::vector<uint> count;
+      std::vector<real> area;
+      std::vector<extents_3> &extents;
+
+      uint leaf_count(uint i) const { return is_leaf(i, leaf_start) ? 1 : count[i]; }
+    };
+
+    // grows a treelet under p by always opening the treelet leaf with the largest area,
+    // then finds the SAH optimal topology over its leaves with a dp over all subsets and
+    // rewires the treelet with its own internal nodes if that beats what is there
+    inline void restructure_treelet(treelet_tree &T, uint p, int n_max)
+    {
+      uint leaves[7] = {T.children[p][0], T.children[p][1]};
+      uint internals[6] = {p};
+      int m = 2, k = 1;
+      while (m < n_max)
+      {
+        int best = -1;
+        real best_area = -1.0;
+        for (int j = 0; j < m; j++)
+        {
+          if (!is_leaf(leaves[j], T.leaf_start) && T.area[leaves[j]] > best_area)
+          {
+            best = j;
+            best_area = T.area[leaves[j]];
+          }
+        }
+        if (best < 0)
+          break;
+        uint q = leaves[best];
+        internals[k++] = q;
+        leaves[best] = T.children[q][0];
+        leaves[m++] = T.children[q][1];
+      }
+      if (m < 3)
+        return;
+
+      real old_cost = 0.0;
+      for (int j = 0; j < k; j++)
+        old_cost += T.area[internals[j]];
+
+      // cost of the best subtree over each subset of leaves, the treelet leaves
+      // themselves are fixed so only the new internal nodes count.
+      // proper subsets of S are always smaller than S, so one increasing sweep works
+      const int full = (1 << m) - 1;
+      real cost[128];
+      int part[128];
+      extents_3 box[128];
+      for (int S = 1; S <= full; S++)
+      {
+        // box of S is the box of S without its lowest leaf grown by that leaf
+        int low = __builtin_ctz(S);
+        const extents_3 &leaf_box = T.extents[leaves[low]];
+        box[S] = (S & (S - 1)) == 0 ? leaf_box : ext::expand(box[S & (S - 1)], leaf_box);
+        if ((S & (S - 1)) == 0)
+        {
+          cost[S] = 0.0;
+          continue;
+        }
+
+        // only partitions holding the lowest bit, the mirrored ones cost the same
+        int lowest = S & -S;
+        real best = std::numeric_limits<real>::max();
+        for (int P = (S - 1) & S; P > 0; P = (P - 1) & S)
+        {
+          if (!(P & lowest))
+            continue;
+          real c = cost[P] + cost[S ^ P];
+          if (c < best)
+          {
+            best = c;
+            part[S] = P;
+          }
+        }
+        cost[S] = ext::area(box[S]) + best;
+      }
+
+      if (cost[full] >= old_cost * (1.0 - 1e-5))
+        return;
+
+      int next = 1;
+      auto rebuild = [&](auto &&self, int S, uint node) -> void
+      {
+        int sub[2] = {part[S], S ^ part[S]};
+        uint c[2];
+        for (int h = 0; h < 2; h++)
+        {
+          if ((sub[h] & (sub[h] - 1)) == 0)
+            c[h] = leaves[__builtin_ctz(sub[h])];
+          else
+          {
+            c[h] = internals[next++];
+            self(self, sub[h], c[h]);
+          }
+          T.parent[c[h]] = node;
+        }
+        T.children[node] = {c[0], c[1]};
+        T.count[node] = T.leaf_count(c[0]) + T.leaf_count(c[1]);
+        T.extents[node] = ext::expand(T.extents[c[0]], T.extents[c[1]]);
+        T.area[node] = ext::area(T.extents[node]);
+      };
+      rebuild(rebuild, full, p);
+    }
+  } // namespace detail
+
+  // treelet restructuring (TRBVH, Karras & Aila 2013) over a built tree and its extents
+  // pyramid. rounds of bottom up passes visit every node once the subtrees under it are
+  // done, like refit_pyramid, so disjoint treelets are optimized in parallel.
+  // leaves move around, so nodes, ids and extents are all replaced by the optimized
+  // tree laid out in the usual karras order
+  void optimize_treelets(std::vector<radix_tree_node> &nodes, std::vector<int> &ids,
+                         std::vector<extents_3> &extents, const treelet_settings &settings = {})
+  {
+    uint leaf_start = get_leaf_start(nodes);
+    if (leaf_start < 2)
+      return;
+    int n_max = std::clamp(settings.max_leaves, 3, 7);
+
+    detail::treelet_tree T = {leaf_start,
+                              std::vector<uint2>(leaf_start),
+                              std::vector<uint>(nodes.size()),
+                              std::vector<uint>(leaf_start, 0),
+                              std::vector<real>(nodes.size()),
+                              extents};
+    parallel_for(0, int(nodes.size()), [&](int i)
+                 {
+      T.parent[i] = nodes[i].parent;
+      T.area[i] = ext::area(extents[i]);
+      if (!is_leaf(i, leaf_start))
+        T.children[i] = {left_child(nodes[i], leaf_start), right_child(nodes[i], leaf_start)}; });
+
+    uint gamma = std::max(settings.min_subtree, 1);
+    std::vector<std::atomic<int>> visits(leaf_start);
+    for (int round = 0; round < settings.iterations; round++, gamma *= 2)
+    {
+      for (auto &v : visits)
+        v.store(0, std::memory_order_relaxed);
+
+      parallel_for(0, int(leaf_start) + 1, [&](int i)
+                   {
+        uint p = T.parent[leaf_start + i];
+        while (p != UNULL)
+        {
+          if (visits[p].fetch_add(1, std::memory_order_acq_rel) == 0)
+            break;
+          T.count[p] = T.leaf_count(T.children[p][0]) + T.leaf_count(T.children[p][1]);
+          if (T.count[p] >= gamma)
+            detail::restructure_treelet(T, p, n_max);
+          p = T.parent[p];
+        } });
+    }
+
+    std::vector<int> ids_out;
+    std::vector<uint> remap;
+    nodes = layout_tree(0, T.children, ids, ids_out, remap);
+    ids.swap(ids_out);
+
+    std::vector<extents_3> extents_out(nodes.size());
+    for (int i = 0; i < nodes.size(); i++)
+      extents_out[i] = extents[remap[i]];
+    extents.swap(extents_out);
+  }
+
+} // mondrian
+
+#endif
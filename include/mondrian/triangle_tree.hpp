@@ -0,0 +1,416 @@
+#ifndef __MONDIAN_TRIANGLE_TREE__
+#define __MONDIAN_TRIANGLE_TREE__
+
+#include <span>
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "wide_bvh.hpp"
+#include "primitives.hpp"
+
+namespace mondrian
+{
+  // closest point of a triangle to a query point, prim is -1 when nothing was found
+  // within the search distance. u, v, w are the barycentric weights of the triangle's
+  // first, second and third vertex, like ray_hit
+  struct point_hit
+  {
+    int prim = -1;
+    vec3 p = vec3(0.0);
+    real d2 = std::numeric_limits<real>::max();
+    real u = 0.0, v = 0.0, w = 0.0;
+
+    bool hit() const { return prim >= 0; }
+    real distance() const { return std::sqrt(d2); }
+  };
+
+  // solid angle of the triangle abc seen from q over 4 pi, positive when q is behind the
+  // triangle with abc counter clockwise, Van Oosterom & Strackee 1983
+  inline real triangle_winding(const vec3 &q, const vec3 &a, const vec3 &b, const vec3 &c)
+  {
+    vec3 A = a - q, B = b - q, C = c - q;
+    real la = glm::length(A), lb = glm::length(B), lc = glm::length(C);
+    real det = glm::dot(A, glm::cross(B, C));
+    real div = la * lb * lc + glm::dot(A, B) * lc + glm::dot(B, C) * la + glm::dot(C, A) * lb;
+    return real(0.5 / M_PI) * std::atan2(det, div);
+  }
+
+  // first order far field of a cluster of triangles, Barill et al. 2018. normal is the
+  // sum of the area weighted normals, center the area weighted centroid and radius2 the
+  // squared distance from it to the farthest corner of the node's box
+  struct dipole_node
+  {
+    vec3 center = vec3(0.0);
+    vec3 normal = vec3(0.0);
+    real radius2 = 0.0;
+  };
+
+  // what gets summed up the tree, the centroids weighted by the triangle areas
+  struct dipole_moment
+  {
+    vec3 normal = vec3(0.0);
+    vec3 moment = vec3(0.0);
+    real area = 0.0;
+  };
+
+  // queries against a triangle mesh, builds the morton tree over calc_extents<3> and
+  // collapses it to the 8 wide layout for traversal. keeps its own copy of the mesh
+  class triangle_tree
+  {
+  public:
+    typedef std::shared_ptr<triangle_tree> ptr;
+
+    static ptr create(const std::vector<int> &indices, const std::vector<vec3> &x)
+    {
+      return std::make_shared<triangle_tree>(indices, x);
+    }
+
+    triangle_tree(const std::vector<int> &indices, const std::vector<vec3> &x)
+        : _indices(indices), _x(x)
+    {
+      _build();
+    }
+
+    // takes the mesh over instead of copying it, for meshes too big to hold twice
+    triangle_tree(std::vector<int> &&indices, std::vector<vec3> &&x)
+        : _indices(std::move(indices)), _x(std::move(x))
+    {
+      _build();
+    }
+
+    // nearest triangle along the ray
+    ray_hit intersect_closest(const ray_t &r, real tmax = ray_tmax) const
+    {
+      ray_hit best;
+      best.t = tmax;
+      watertight_ray wr(r);
+      traverse_bvh8(_wide, r, tmax, [&](uint first, uint count, real &t)
+                    {
+        for (uint j = first; j < first + count; j++)
+        {
+          int prim = _tree.ids[j];
+          ray_hit hit;
+          if (intersect_triangle(wr, vertex(prim, 0), vertex(prim, 1), vertex(prim, 2), t, hit))
+          {
+            hit.prim = prim;
+            best = hit;
+            t = hit.t;
+          }
+        }
+        return false; });
+      return best;
+    }
+
+    // true as soon as any triangle is hit before tmax, for shadow and visibility rays
+    bool intersect_any(const ray_t &r, real tmax) const
+    {
+      bool found = false;
+      watertight_ray wr(r);
+      traverse_bvh8(_wide, r, tmax, [&](uint first, uint count, real &t)
+                    {
+        for (uint j = first; j < first + count; j++)
+        {
+          int prim = _tree.ids[j];
+          ray_hit hit;
+          if (intersect_triangle(wr, vertex(prim, 0), vertex(prim, 1), vertex(prim, 2), t, hit))
+          {
+            found = true;
+            return true;
+          }
+        }
+        return false; });
+      return found;
+    }
+
+    // closest point on the mesh to p within max_dist, the closest_point of a triangle_set
+    // on the binary tree. hint is a triangle likely to be close, like the answer for the
+    // previous point of a scan, it only sets the starting bound
+    point_hit closest_point(const vec3 &p, real max_dist = ray_tmax, int hint = -1) const
+    {
+      std::vector<std::pair<real, uint>> stack;
+      return _closest_point(p, max_dist, hint, stack);
+    }
+
+    // batched closest points, for grids and particle sets. consecutive points hand
+    // their answer on as the hint for the next one, so keep the points in scan or
+    // morton order
+    std::vector<point_hit> closest_point(std::span<const vec3> points, real max_dist = ray_tmax) const
+    {
+      std::vector<point_hit> hits(points.size());
+      parallel_for_chunks(
+          0, int(points.size()), [&](int, int b, int e)
+          {
+            int hint = -1;
+            std::vector<std::pair<real, uint>> stack;
+            for (int i = b; i < e; i++)
+            {
+              hits[i] = _closest_point(points[i], max_dist, hint, stack);
+              if (hits[i].hit())
+                hint = hits[i].prim;
+            } },
+          256);
+      return hits;
+    }
+
+    // unsigned distance to the mesh, max_dist where nothing is closer. the sampling
+    // of a distance field narrow band
+    std::vector<real> distance(std::span<const vec3> points, real max_dist = ray_tmax) const
+    {
+      std::vector<point_hit> hits = closest_point(points, max_dist);
+      std::vector<real> d(hits.size());
+      for (int i = 0; i < hits.size(); i++)
+        d[i] = hits[i].hit() ? hits[i].distance() : max_dist;
+      return d;
+    }
+
+    // generalized winding number of the mesh at q, 1 inside and 0 outside a closed,
+    // outward facing mesh and a smooth in between value for open or broken ones.
+    // a node whose triangles all lie within its radius is taken as one dipole once q is
+    // more than beta radii away, larger beta is more accurate and slower, 2 is usually
+    // enough to threshold at 0.5
+    real winding_number(const vec3 &q, real beta = 2.0) const
+    {
+      std::vector<uint> stack;
+      return _winding_number(q, beta, stack);
+    }
+
+    // batched winding numbers, for voxelizing and seeding particles on dense grids
+    std::vector<real> winding_number(std::span<const vec3> points, real beta = 2.0) const
+    {
+      std::vector<real> w(points.size());
+      parallel_for_chunks(
+          0, int(points.size()), [&](int, int b, int e)
+          {
+            std::vector<uint> stack;
+            for (int i = b; i < e; i++)
+              w[i] = _winding_number(points[i], beta, stack); },
+          256);
+      return w;
+    }
+
+    // inside test, the winding number thresholded at one half
+    std::vector<bool> inside(std::span<const vec3> points, real beta = 2.0) const
+    {
+      std::vector<real> w = winding_number(points, beta);
+      std::vector<bool> in(w.size());
+      for (int i = 0; i < w.size(); i++)
+        in[i] = w[i] > 0.5f;
+      return in;
+    }
+
+    // batched variants, rays are split across threads in contiguous chunks
+    std::vector<ray_hit> intersect_closest(std::span<const ray_t> rays, real tmax = ray_tmax) const
+    {
+      std::vector<ray_hit> hits(rays.size());
+      parallel_for(
+          0, int(rays.size()), [&](int i)
+          { hits[i] = intersect_closest(rays[i], tmax); },
+          256);
+      return hits;
+    }
+
+    std::vector<bool> intersect_any(std::span<const ray_t> rays, real tmax) const
+    {
+      // vector<bool> packs bits, so threads fill bytes and copy once
+      std::vector<uint8_t> found(rays.size());
+      parallel_for(
+          0, int(rays.size()), [&](int i)
+          { found[i] = intersect_any(rays[i], tmax); },
+          256);
+      return std::vector<bool>(found.begin(), found.end());
+    }
+
+    // stream variants for large incoherent batches, the rays are reordered with
+    // sort_rays and traced in packets of 32 neighbors so every node fetched serves
+    // the whole packet. sorting, gathering and scattering cost about as much per ray
+    // as a traversal that stays in cache, so trees smaller than stream_min_bytes go
+    // through the one ray at a time batches instead. on 100K random rays the stream
+    // is 10 to 20% faster from about 1M triangles (75 MB of bvh8 nodes), on par
+    // around 200K and up to 2x slower below 50K if forced
+    std::vector<ray_hit> intersect_closest_stream(std::span<const ray_t> rays, real tmax = ray_tmax) const
+    {
+      if (!_use_stream())
+        return intersect_closest(rays, tmax);
+      std::vector<ray_hit> hits(rays.size());
+      _trace_stream(rays, tmax, [&](int id, const ray_hit &hit, bool)
+                    { hits[id] = hit; },
+                    false);
+      return hits;
+    }
+
+    std::vector<bool> intersect_any_stream(std::span<const ray_t> rays, real tmax) const
+    {
+      if (!_use_stream())
+        return intersect_any(rays, tmax);
+      std::vector<uint8_t> found(rays.size());
+      _trace_stream(rays, tmax, [&](int id, const ray_hit &, bool any)
+                    { found[id] = any; },
+                    true);
+      return std::vector<bool>(found.begin(), found.end());
+    }
+
+    const vec3 &vertex(int prim, int k) const { return _x[_indices[3 * prim + k]]; }
+
+    // size of the bvh8 nodes from which the stream variants sort rays into packets,
+    // roughly the last level cache. 0 always streams
+    size_t stream_min_bytes = size_t(16) << 20;
+
+    const aabb_tree &tree() const { return _tree; }
+    const std::vector<bvh8_node> &wide() const { return _wide; }
+    const std::vector<int> &indices() const { return _indices; }
+    const std::vector<vec3> &x() const { return _x; }
+
+  protected:
+    void _build()
+    {
+      if (_indices.size() < 3)
+        return;
+      _tree = build_aabb_tree<3>(_indices, _x);
+      _wide = collapse_bvh8(_tree.nodes, _tree.extents);
+      _build_dipoles();
+    }
+
+    // the search of the primitive sets over a view of the mesh, the barycentrics are
+    // only worked out again for the answer. stack is scratch space handed in by the
+    // caller so batches reuse one allocation
+    point_hit _closest_point(const vec3 &p, real max_dist, int hint, std::vector<std::pair<real, uint>> &stack) const
+    {
+      primitive_hit<real> h = detail::closest_point(_tree, triangle_set<real>(_indices, _x), p, max_dist, hint, stack);
+      point_hit best;
+      best.d2 = h.d2;
+      if (!h.hit())
+        return best;
+      real u, v, w;
+      closest_point_triangle(p, vertex(h.prim, 0), vertex(h.prim, 1), vertex(h.prim, 2), u, v, w);
+      return {h.prim, h.p, h.d2, u, v, w};
+    }
+
+    real _winding_number(const vec3 &q, real beta, std::vector<uint> &stack) const
+    {
+      if (_tree.size() == 0)
+        return 0.0;
+      uint leaf_start = _tree.leaf_start();
+      real beta2 = beta * beta;
+      double w = 0.0;
+      stack.clear();
+      stack.push_back(0);
+      while (stack.size() > 0)
+      {
+        uint i = stack.back();
+        stack.pop_back();
+        if (is_leaf(i, leaf_start))
+        {
+          int prim = _tree.ids[i - leaf_start];
+          w += triangle_winding(q, vertex(prim, 0), vertex(prim, 1), vertex(prim, 2));
+          continue;
+        }
+        const dipole_node &d = _dipoles[i];
+        vec3 r = d.center - q;
+        real r2 = glm::dot(r, r);
+        if (r2 > beta2 * d.radius2)
+        {
+          w += real(0.25 / M_PI) * glm::dot(r, d.normal) / (r2 * std::sqrt(r2));
+          continue;
+        }
+        stack.push_back(left_child(_tree.nodes[i], leaf_start));
+        stack.push_back(right_child(_tree.nodes[i], leaf_start));
+      }
+      return real(w);
+    }
+
+    // dipole moments per node with the bottom up pyramid, the insertion build_pyramid
+    // would count every triangle once per level
+    void _build_dipoles()
+    {
+      int N = _tree.size();
+      std::vector<dipole_moment> leaves(N);
+      parallel_for(0, N, [&](int j)
+                   {
+        int prim = _tree.ids[j];
+        const vec3 &a = vertex(prim, 0), &b = vertex(prim, 1), &c = vertex(prim, 2);
+        vec3 n = 0.5f * glm::cross(b - a, c - a);
+        real area = glm::length(n);
+        leaves[j] = {n, area * (a + b + c) / 3.0f, area}; });
+
+      std::vector<dipole_moment> moments = build_pyramid_bottom_up<dipole_moment>(
+          leaves, _tree.nodes,
+          []()
+          { return dipole_moment(); },
+          [](const dipole_moment &a, const dipole_moment &b)
+          { return dipole_moment{a.normal + b.normal, a.moment + b.moment, a.area + b.area}; });
+
+      _dipoles.resize(_tree.nodes.size());
+      parallel_for(0, int(_dipoles.size()), [&](int i)
+                   {
+        const extents_3 &e = _tree.extents[i];
+        const dipole_moment &m = moments[i];
+        vec3 c = m.area > 0.0 ? m.moment / m.area : 0.5f * (e[0] + e[1]);
+        // farthest corner of the box, a bound on the distance to every triangle in it
+        vec3 d = max(abs(e[0] - c), abs(e[1] - c));
+        _dipoles[i] = {c, m.normal, glm::dot(d, d)}; });
+    }
+
+    bool _use_stream() const { return _wide.size() * sizeof(bvh8_node) >= stream_min_bytes; }
+
+    // result(id, closest hit, any hit) is called once per ray. the rays are gathered
+    // into sort order first and the answers scattered back at the end, two streaming
+    // passes instead of a cache miss on each side of every traversal
+    template <typename RESULT>
+    void _trace_stream(std::span<const ray_t> rays, real tmax, RESULT &&result, bool any) const
+    {
+      const int packet = 32;
+      std::vector<int> order = sort_rays(rays);
+      int N = rays.size();
+      std::vector<ray_t> sorted(N);
+      parallel_for(0, N, [&](int k)
+                   { sorted[k] = rays[order[k]]; });
+
+      std::vector<ray_hit> best(N);
+      std::vector<uint8_t> found(N, 0);
+      int n_packets = (N + packet - 1) / packet;
+      parallel_for(
+          0, n_packets, [&](int p)
+          {
+            int b = p * packet, n = std::min(packet, N - b);
+            const ray_t *r = sorted.data() + b;
+            watertight_ray wr[packet];
+            real t[packet];
+            for (int i = 0; i < n; i++)
+            {
+              wr[i] = watertight_ray(r[i]);
+              best[b + i].t = t[i] = tmax;
+            }
+
+            traverse_bvh8_packet(_wide, r, n, t, [&](int i, uint first, uint count, real &tm)
+                                 {
+              for (uint j = first; j < first + count; j++)
+              {
+                int prim = _tree.ids[j];
+                ray_hit hit;
+                if (intersect_triangle(wr[i], vertex(prim, 0), vertex(prim, 1), vertex(prim, 2), tm, hit))
+                {
+                  found[b + i] = 1;
+                  if (any)
+                    return true;
+                  hit.prim = prim;
+                  best[b + i] = hit;
+                  tm = hit.t;
+                }
+              }
+              return false; }); },
+          4);
+
+      parallel_for(0, N, [&](int k)
+                   { result(order[k], best[k], bool(found[k])); });
+    }
+
+    std::vector<int> _indices;
+    std::vector<vec3> _x;
+    aabb_tree _tree;
+    std::vector<bvh8_node> _wide;
+    std::vector<dipole_node> _dipoles;
+  };
+
+} // mondrian
+
+#endif
@@ -0,0 +1,371 @@
+#ifndef __MONDIAN_WIDE_BVH__
+#define __MONDIAN_WIDE_BVH__
+
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "aabb.hpp"
+#include "ray.hpp"
+
+namespace mondrian
+{
+  // 8 wide node collapsed from the binary tree, child bounds are stored SoA so one
+  // ray is tested against all 8 boxes at once. a slot with count == 0 points at another
+  // bvh8_node, otherwise it is the range [child, child + count) of leaves in the sorted
+  // ids order. only the first n_children slots are used
+  struct alignas(32) bvh8_node
+  {
+    float min_x[8], min_y[8], min_z[8];
+    float max_x[8], max_y[8], max_z[8];
+    uint child[8];
+    uint8_t count[8];
+    uint8_t n_children;
+  };
+
+  static_assert(sizeof(bvh8_node) == 256, "bvh8_node should stay 4 cache lines");
+
+  // top down collapse, every wide node starts from the two children of a binary node and
+  // keeps opening the inner child with the largest area until it has 8 slots
+  std::vector<bvh8_node> collapse_bvh8(const std::vector<radix_tree_node> &nodes,
+                                       const std::vector<extents_3> &extents)
+  {
+    uint leaf_start = get_leaf_start(nodes);
+    std::vector<bvh8_node> wide(1);
+    std::vector<std::array<uint, 2>> queue = {{0, 0}}; // binary node, wide node
+
+    while (queue.size() > 0)
+    {
+      auto [bi, wi] = queue.back();
+      queue.pop_back();
+
+      uint slots[8];
+      int n = 0;
+      if (is_leaf(bi, leaf_start))
+        slots[n++] = bi;
+      else
+      {
+        slots[n++] = left_child(nodes[bi], leaf_start);
+        slots[n++] = right_child(nodes[bi], leaf_start);
+      }
+      while (n < 8)
+      {
+        int best = -1;
+        real best_area = -1.0;
+        for (int j = 0; j < n; j++)
+        {
+          if (is_leaf(slots[j], leaf_start))
+            continue;
+          real a = ext::area(extents[slots[j]]);
+          if (a > best_area)
+            best = j, best_area = a;
+        }
+        if (best < 0)
+          break;
+        uint s = slots[best];
+        slots[best] = left_child(nodes[s], leaf_start);
+        slots[n++] = right_child(nodes[s], leaf_start);
+      }
+
+      bvh8_node w = {};
+      w.n_children = n;
+      for (int j = 0; j < 8; j++)
+      {
+        ext::extents_t e = j < n ? extents[slots[j]] : ext::init();
+        w.min_x[j] = e[0][0], w.min_y[j] = e[0][1], w.min_z[j] = e[0][2];
+        w.max_x[j] = e[1][0], w.max_y[j] = e[1][1], w.max_z[j] = e[1][2];
+        w.child[j] = UNULL;
+        if (j >= n)
+          continue;
+        if (is_leaf(slots[j], leaf_start))
+        {
+          w.child[j] = slots[j] - leaf_start;
+          w.count[j] = 1;
+        }
+        else
+        {
+          w.child[j] = wide.size();
+          wide.push_back(bvh8_node());
+          queue.push_back({slots[j], w.child[j]});
+        }
+      }
+      wide[wi] = w;
+    }
+    return wide;
+  }
+
+  // ray against the 8 child boxes of a node, returns a bit mask of the slots hit
+  // inside [tmin, tmax] and their entry distances in tnear
+  inline uint ray_box8_scalar(const bvh8_node &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    uint mask = 0;
+    for (int j = 0; j < w.n_children; j++)
+    {
+      ext::extents_t e = {vec3(w.min_x[j], w.min_y[j], w.min_z[j]),
+                          vec3(w.max_x[j], w.max_y[j], w.max_z[j])};
+      if (ray_box(r, e, tmin, tmax, tnear[j]))
+        mask |= 1u << j;
+    }
+    return mask;
+  }
+
+#if defined(__SSE2__)
+  inline uint ray_box8_sse(const bvh8_node &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    const __m128 ox = _mm_set1_ps(r.o[0]), oy = _mm_set1_ps(r.o[1]), oz = _mm_set1_ps(r.o[2]);
+    const __m128 ix = _mm_set1_ps(r.inv_d[0]), iy = _mm_set1_ps(r.inv_d[1]), iz = _mm_set1_ps(r.inv_d[2]);
+    uint mask = 0;
+    for (int h = 0; h < 8; h += 4)
+    {
+      __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.min_x + h), ox), ix);
+      __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.max_x + h), ox), ix);
+      __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.min_y + h), oy), iy);
+      __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.max_y + h), oy), iy);
+      __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.min_z + h), oz), iz);
+      __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(w.max_z + h), oz), iz);
+      __m128 tn = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+                             _mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin)));
+      __m128 tf = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+                             _mm_min_ps(_mm_max_ps(t0z, t1z), _mm_set1_ps(tmax)));
+      _mm_storeu_ps(tnear + h, tn);
+      mask |= uint(_mm_movemask_ps(_mm_cmple_ps(tn, tf))) << h;
+    }
+    return mask & ((1u << w.n_children) - 1);
+  }
+#endif
+
+#if defined(__AVX2__)
+  // slab test of one ray against 8 boxes already in registers, the mask is not
+  // limited to the used slots yet
+  inline uint slab8_avx2(__m256 min_x, __m256 min_y, __m256 min_z, __m256 max_x, __m256 max_y, __m256 max_z,
+                         const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    const __m256 ox = _mm256_set1_ps(r.o[0]), oy = _mm256_set1_ps(r.o[1]), oz = _mm256_set1_ps(r.o[2]);
+    const __m256 ix = _mm256_set1_ps(r.inv_d[0]), iy = _mm256_set1_ps(r.inv_d[1]), iz = _mm256_set1_ps(r.inv_d[2]);
+    __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(min_x, ox), ix);
+    __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(max_x, ox), ix);
+    __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(min_y, oy), iy);
+    __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(max_y, oy), iy);
+    __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(min_z, oz), iz);
+    __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(max_z, oz), iz);
+    __m256 tn = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+                              _mm256_max_ps(_mm256_min_ps(t0z, t1z), _mm256_set1_ps(tmin)));
+    __m256 tf = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+                              _mm256_min_ps(_mm256_max_ps(t0z, t1z), _mm256_set1_ps(tmax)));
+    _mm256_storeu_ps(tnear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+  }
+
+  inline uint ray_box8_avx2(const bvh8_node &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+    uint mask = slab8_avx2(_mm256_load_ps(w.min_x), _mm256_load_ps(w.min_y), _mm256_load_ps(w.min_z),
+                           _mm256_load_ps(w.max_x), _mm256_load_ps(w.max_y), _mm256_load_ps(w.max_z),
+                           r, tmin, tmax, tnear);
+    return mask & ((1u << w.n_children) - 1);
+  }
+#endif
+
+  // widest kernel the compiler was allowed to target
+  inline uint ray_box8(const bvh8_node &w, const ray_t &r, real tmin, real tmax, float tnear[8])
+  {
+#if defined(__AVX2__)
+    return ray_box8_avx2(w, r, tmin, tmax, tnear);
+#elif defined(__SSE2__)
+    return ray_box8_sse(w, r, tmin, tmax, tnear);
+#else
+    return ray_box8_scalar(w, r, tmin, tmax, tnear);
+#endif
+  }
+
+  namespace detail
+  {
+    // traversal stack that lives on the call stack while it fits and moves to the heap
+    // when a deep tree (ploc, binned sah, clustered inputs) needs more. reserve room
+    // before pushing a node's children, indexing never checks
+    template <typename T, int N = 256>
+    struct traversal_stack
+    {
+      T local[N];
+      std::vector<T> heap;
+      T *data = local;
+      int capacity = N;
+
+      void reserve(int n)
+      {
+        if (n <= capacity)
+          return;
+        if (data == local)
+          heap.assign(local, local + N);
+        capacity = std::max(2 * capacity, n);
+        heap.resize(capacity);
+        data = heap.data();
+      }
+
+      T &operator[](int i) { return data[i]; }
+    };
+  } // namespace detail
+
+  // front to back ray traversal, leaf(first, count, tmax) is called for every leaf range
+  // the ray enters before tmax, it may shrink tmax (closest hit) and returns true to
+  // stop the traversal (any hit). NODE is any 8 wide node with child, count and a
+  // ray_box8 overload. root is the node to start from, the packet traversal hands
+  // rays over to this one in the middle of the tree
+  template <typename NODE, typename LEAF>
+  void traverse_bvh8(const std::vector<NODE> &wide, const ray_t &r, real tmax, LEAF &&leaf, uint root = 0)
+  {
+    if (wide.empty())
+      return;
+    struct entry
+    {
+      uint child;
+      uint count;
+      float t;
+    };
+    // at most 7 entries are left behind per level
+    detail::traversal_stack<entry> stack;
+    int sp = 0;
+    stack[sp++] = {root, 0, 0.0f};
+
+    while (sp > 0)
+    {
+      entry e = stack[--sp];
+      if (e.t > tmax)
+        continue;
+      if (e.count > 0)
+      {
+        if (leaf(e.child, e.count, tmax))
+          return;
+        continue;
+      }
+
+      const NODE &w = wide[e.child];
+      float tnear[8];
+      uint mask = ray_box8(w, r, 0.0f, tmax, tnear);
+
+      // push far to near so the nearest child is popped first
+      stack.reserve(sp + 8);
+      int base = sp;
+      while (mask)
+      {
+        int j = __builtin_ctz(mask);
+        mask &= mask - 1;
+        entry c = {w.child[j], w.count[j], tnear[j]};
+        int k = sp++;
+        while (k > base && stack[k - 1].t < c.t)
+        {
+          stack[k] = stack[k - 1];
+          k--;
+        }
+        stack[k] = c;
+      }
+    }
+  }
+
+  // packet traversal for up to 32 rays that tend to visit the same nodes (see sort_rays).
+  // every node is fetched once for the whole packet and tested against each ray still in
+  // its mask, children are pushed with the mask of the rays that entered them, nearest
+  // first by the closest entry among those rays. leaf(i, first, count, tmax[i]) is
+  // called per ray of the packet and returns true when ray i is done (any hit).
+  // incoherent rays split up after a few levels, once fewer than min_rays enter a node
+  // the shared fetch no longer pays for the per ray mask work and the rays finish the
+  // subtree one at a time with traverse_bvh8
+  template <typename NODE, typename LEAF>
+  void traverse_bvh8_packet(const std::vector<NODE> &wide, const ray_t *rays, int n, real *tmax, LEAF &&leaf,
+                            int min_rays = 8)
+  {
+    if (wide.empty() || n == 0)
+      return;
+    assert(n <= 32);
+    struct entry
+    {
+      uint child;
+      uint count;
+      uint mask;
+      float t;
+    };
+    detail::traversal_stack<entry> stack;
+    int sp = 0;
+    uint active = n == 32 ? ~0u : (1u << n) - 1;
+    stack[sp++] = {0, 0, active, 0.0f};
+
+    while (sp > 0)
+    {
+      entry e = stack[--sp];
+      uint mask = e.mask & active;
+      if (mask == 0)
+        continue;
+      if (e.count > 0)
+      {
+        while (mask)
+        {
+          int i = __builtin_ctz(mask);
+          mask &= mask - 1;
+          if (e.t <= tmax[i] && leaf(i, e.child, e.count, tmax[i]))
+            active &= ~(1u << i);
+        }
+        continue;
+      }
+
+      if (__builtin_popcount(mask) < min_rays)
+      {
+        while (mask)
+        {
+          int i = __builtin_ctz(mask);
+          mask &= mask - 1;
+          bool done = false;
+          traverse_bvh8(
+              wide, rays[i], tmax[i], [&](uint first, uint count, real &t)
+              {
+                done = leaf(i, first, count, t);
+                tmax[i] = t;
+                return done; },
+              e.child);
+          if (done)
+            active &= ~(1u << i);
+        }
+        continue;
+      }
+
+      const NODE &w = wide[e.child];
+      uint child_mask[8] = {};
+      float child_t[8];
+      std::fill(child_t, child_t + 8, ext::inf_t);
+      while (mask)
+      {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+        float tnear[8];
+        uint hit = ray_box8(w, rays[i], 0.0f, tmax[i], tnear);
+        while (hit)
+        {
+          int j = __builtin_ctz(hit);
+          hit &= hit - 1;
+          child_mask[j] |= 1u << i;
+          child_t[j] = std::min(child_t[j], tnear[j]);
+        }
+      }
+
+      // push far to near so the nearest child is popped first
+      stack.reserve(sp + 8);
+      int base = sp;
+      for (int j = 0; j < w.n_children; j++)
+      {
+        if (child_mask[j] == 0)
+          continue;
+        entry c = {w.child[j], w.count[j], child_mask[j], child_t[j]};
+        int k = sp++;
+        while (k > base && stack[k - 1].t < c.t)
+        {
+          stack[k] = stack[k - 1];
+          k--;
+        }
+        stack[k] = c;
+      }
+    }
+  }
+
+} // mondrian
+
+#endif
@@ -0,0 +1,924 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+
+#include "mondrian/aabb.hpp"
+#include "mondrian/treelet.hpp"
+#include "mondrian/ploc.hpp"
+#include "mondrian/binned_sah.hpp"
+#include "mondrian/flat_bvh.hpp"
+#include "mondrian/wide_bvh.hpp"
+#include "mondrian/compressed_bvh.hpp"
+#include "mondrian/triangle_tree.hpp"
+#include "mondrian/overlap.hpp"
+#include "mondrian/neighbors.hpp"
+#include "mondrian/dynamic_tree.hpp"
+#include "mondrian/spatial_hash.hpp"
+#include "mondrian/tree_cache.hpp"
+#include "mondrian/async_tree.hpp"
+#include "mondrian/primitives.hpp"
+#include "mondrian/barnes_hut.hpp"
+
+// times a callable, best of n_runs in milliseconds
+template <typename F>
+double time_ms(F &&f, int n_runs = 5)
+{
+  double best = std::numeric_limits<double>::max();
+  for (int i = 0; i < n_runs; i++)
+  {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    f();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+  }
+  return best;
+}
+
+void bench_build_tree(int N, int max_threads)
+{
+  mondrian::test_case M(N, 3);
+  std::vector<vec3> cens = mondrian::get_cens(M);
+  std::vector<int> hash = mondrian::calc_morton_codes(cens);
+  std::vector<int> ids = mondrian::sort_by_code(hash);
+
+  std::cout << "build_tree, N = " << N << std::endl;
+  // powers of two and always max_threads itself, which often isn't one
+  std::vector<int> counts;
+  for (int t = 1; t < max_threads; t *= 2)
+    counts.push_back(t);
+  counts.push_back(max_threads);
+
+  double t1 = 0.0;
+  for (int t : counts)
+  {
+    mondrian::set_num_threads(t);
+    double ms = time_ms([&]()
+                        { mondrian::build_tree(ids, hash); });
+    if (t == 1)
+      t1 = ms;
+    std::cout << "  threads: " << std::setw(3) << t
+              << "  " << std::setw(9) << std::fixed << std::setprecision(3) << ms << " ms"
+              << "  " << std::setw(8) << real(N) / ms * 1e-3 << " Mprims/s"
+              << "  speedup: " << std::setprecision(2) << t1 / ms << std::endl;
+  }
+  mondrian::set_num_threads(0);
+}
+
+// the separate centroid, bounds and key passes against the fused streams
+void bench_morton_codes(int N)
+{
+  mondrian::test_case M(N, 3);
+  double serial_ms = time_ms([&]()
+                             { mondrian::calc_morton_codes(mondrian::get_cens(M)); });
+  double fused_ms = time_ms([&]()
+                            {
+    mondrian::centroids cens;
+    mondrian::ext::extents_t bounds = mondrian::calc_centroids<3>(M.indices(), M.x(), cens);
+    mondrian::calc_morton_codes(cens, bounds); });
+
+  std::cout << "morton codes, N = " << N << std::endl;
+  std::cout << "  get_cens + calc_morton_codes: " << std::fixed << std::setprecision(3) << serial_ms << " ms" << std::endl;
+  std::cout << "  calc_centroids + streams:     " << fused_ms << " ms"
+            << "  speedup: " << std::setprecision(2) << serial_ms / fused_ms << std::endl;
+}
+
+void bench_sort(int N)
+{
+  mondrian::test_case M(N, 3);
+  std::vector<int> hash = mondrian::calc_morton_codes(mondrian::get_cens(M));
+
+  double std_ms = time_ms([&]()
+                          {
+    std::vector<int> ids(hash.size());
+    for (int i = 0; i < ids.size(); i++)
+      ids[i] = i;
+    std::sort(ids.begin(), ids.end(), [&](int a, int b)
+              { return hash[a] < hash[b]; }); });
+  double radix_ms = time_ms([&]()
+                            { mondrian::sort_by_code(hash); });
+
+  std::cout << "sort, N = " << N << std::endl;
+  std::cout << "  std::sort:        " << std::fixed << std::setprecision(3) << std_ms << " ms" << std::endl;
+  std::cout << "  radix_sort_pairs: " << radix_ms << " ms"
+            << "  speedup: " << std::setprecision(2) << std_ms / radix_ms << std::endl;
+}
+
+void bench_pyramid(int N)
+{
+  mondrian::test_case M(N, 3);
+  std::vector<int> hash = mondrian::calc_morton_codes(mondrian::get_cens(M));
+  std::vector<int> ids = mondrian::sort_by_code(hash);
+  std::vector<mondrian::radix_tree_node> nodes = mondrian::build_tree(ids, hash);
+  std::vector<mondrian::extents_3> extents(ids.size());
+  for (int i = 0; i < ids.size(); i++)
+    extents[i] = mondrian::calc_extents<3>(ids[i], M.indices(), M.x());
+
+  auto init = []()
+  { return mondrian::ext::init(); };
+  auto op = [](const mondrian::extents_3 &a, const mondrian::extents_3 &b)
+  { return mondrian::pyramid(a, b); };
+
+  double insert_ms = time_ms([&]()
+                             { mondrian::build_pyramid<mondrian::extents_3>(extents, ids.size() - 1, nodes, init, op); });
+  double bottom_up_ms = time_ms([&]()
+                                { mondrian::build_pyramid_bottom_up<mondrian::extents_3>(extents, nodes, init, op); });
+
+  std::cout << "pyramid, N = " << N << std::endl;
+  std::cout << "  leaf insertion: " << std::fixed << std::setprecision(3) << insert_ms << " ms" << std::endl;
+  std::cout << "  bottom up:      " << bottom_up_ms << " ms"
+            << "  speedup: " << std::setprecision(2) << insert_ms / bottom_up_ms << std::endl;
+}
+
+// number of leaf boxes containing each centroid, a stand in point query until
+// there is a proper query api, it walks the same nodes a real query does
+int count_containing(const std::vector<mondrian::radix_tree_node> &nodes,
+                     const std::vector<mondrian::extents_3> &ext, const vec3 &p)
+{
+  uint leaf_start = mondrian::get_leaf_start(nodes);
+  mondrian::ext::extents_t q = {p, p};
+  int count = 0;
+  std::vector<uint> stack = {0};
+  while (stack.size() > 0)
+  {
+    uint i = stack.back();
+    stack.pop_back();
+    if (!mondrian::ext::overlap(ext[i], q))
+      continue;
+    if (mondrian::is_leaf(i, leaf_start))
+    {
+      count++;
+      continue;
+    }
+    stack.push_back(mondrian::left_child(nodes[i], leaf_start));
+    stack.push_back(mondrian::right_child(nodes[i], leaf_start));
+  }
+  return count;
+}
+
+template <typename K>
+void bench_key(const std::string &name, const mondrian::test_case &M)
+{
+  std::vector<vec3> cens = mondrian::get_cens(M);
+  std::vector<K> hash = mondrian::calc_morton_codes<K>(cens);
+  std::vector<int> ids = mondrian::sort_by_code(hash);
+  std::vector<mondrian::radix_tree_node> nodes = mondrian::build_tree(ids, hash);
+
+  int dups = 0;
+  for (int i = 1; i < ids.size(); i++)
+    dups += hash[ids[i]] == hash[ids[i - 1]];
+
+  std::vector<mondrian::extents_3> extents(ids.size());
+  for (int i = 0; i < ids.size(); i++)
+    extents[i] = mondrian::calc_extents<3>(ids[i], M.indices(), M.x());
+  std::vector<mondrian::extents_3> ext = mondrian::build_pyramid_bottom_up<mondrian::extents_3>(
+      extents, nodes,
+      []()
+      { return mondrian::ext::init(); },
+      [](const mondrian::extents_3 &a, const mondrian::extents_3 &b)
+      { return mondrian::pyramid(a, b); });
+
+  int n_queries = std::min<int>(cens.size(), 10000);
+  int query_stride = cens.size() / n_queries;
+  long hits = 0;
+  double ms = time_ms([&]()
+                      {
+    hits = 0;
+    for (int i = 0; i < n_queries; i++)
+      hits += count_containing(nodes, ext, cens[i * query_stride]); },
+                      1);
+
+  std::array<real, 2> depth = mondrian::tree_depth(nodes);
+  std::cout << "  " << name
+            << "  duplicate codes: " << std::setw(8) << dups
+            << "  max depth: " << std::setw(5) << int(depth[0])
+            << "  mean leaf depth: " << std::setw(8) << std::fixed << std::setprecision(2) << depth[1]
+            << "  point queries: " << std::setw(8) << real(n_queries) / ms * 1e3 << " q/s" << std::endl;
+}
+
+// test_case triangles span the whole cube, pull every vertex toward its
+// triangle centroid so the boxes look like a real mesh
+void shrink_triangles(mondrian::test_case &M, real s)
+{
+  std::vector<vec3> cens = mondrian::get_cens(M);
+  for (int i = 0; i < M.indices().size(); i++)
+  {
+    vec3 &x = M.x()[M.indices()[i]];
+    const vec3 &c = cens[i / M.stride()];
+    x = c + s * (x - c);
+  }
+}
+
+// SAH cost against optimization time for a few treelet settings
+void bench_treelets(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  std::vector<int> hash = mondrian::calc_morton_codes(mondrian::get_cens(M));
+  std::vector<int> ids0 = mondrian::sort_by_code(hash);
+  std::vector<mondrian::radix_tree_node> nodes0 = mondrian::build_tree(ids0, hash);
+  std::vector<mondrian::extents_3> extents(ids0.size());
+  for (int i = 0; i < ids0.size(); i++)
+    extents[i] = mondrian::calc_extents<3>(ids0[i], M.indices(), M.x());
+  std::vector<mondrian::extents_3> ext0 = mondrian::build_pyramid_bottom_up<mondrian::extents_3>(
+      extents, nodes0,
+      []()
+      { return mondrian::ext::init(); },
+      [](const mondrian::extents_3 &a, const mondrian::extents_3 &b)
+      { return mondrian::pyramid(a, b); });
+
+  std::cout << "treelets, N = " << N << std::endl;
+  std::cout << "  lbvh                      sah: " << std::fixed << std::setprecision(3)
+            << mondrian::sah_cost(nodes0, ext0) << std::endl;
+  for (auto [leaves, iterations] : std::vector<std::array<int, 2>>{{5, 1}, {7, 1}, {7, 3}})
+  {
+    std::vector<mondrian::radix_tree_node> nodes;
+    std::vector<int> ids;
+    std::vector<mondrian::extents_3> ext;
+    double ms = time_ms([&]()
+                        {
+      nodes = nodes0;
+      ids = ids0;
+      ext = ext0;
+      mondrian::optimize_treelets(nodes, ids, ext, {leaves, iterations}); },
+                        1);
+    std::cout << "  leaves: " << leaves << " iterations: " << iterations
+              << "  sah: " << mondrian::sah_cost(nodes, ext)
+              << "  " << ms << " ms" << std::endl;
+  }
+}
+
+// clustering builder against the karras build, full builds from the same triangles
+void bench_ploc(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  mondrian::aabb_tree tree;
+  double lbvh_ms = time_ms([&]()
+                           { tree = mondrian::build_aabb_tree<3>(M.indices(), M.x()); },
+                           1);
+
+  std::cout << "ploc, N = " << N << std::endl;
+  std::cout << "  lbvh        sah: " << std::fixed << std::setprecision(3)
+            << mondrian::sah_cost(tree.nodes, tree.extents) << "  " << lbvh_ms << " ms" << std::endl;
+  for (int radius : {4, 8, 16})
+  {
+    double ms = time_ms([&]()
+                        { tree = mondrian::build_ploc_tree<3>(M.indices(), M.x(), {radius}); },
+                        1);
+    std::cout << "  radius: " << std::setw(2) << radius
+              << "  sah: " << mondrian::sah_cost(tree.nodes, tree.extents)
+              << "  " << ms << " ms" << std::endl;
+  }
+}
+
+// top down binned SAH, bin count against tree quality and build time
+void bench_binned_sah(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  mondrian::aabb_tree tree;
+  double lbvh_ms = time_ms([&]()
+                           { tree = mondrian::build_aabb_tree<3>(M.indices(), M.x()); },
+                           1);
+
+  std::cout << "binned sah, N = " << N << std::endl;
+  std::cout << "  lbvh      sah: " << std::fixed << std::setprecision(3)
+            << mondrian::sah_cost(tree.nodes, tree.extents) << "  " << lbvh_ms << " ms" << std::endl;
+  for (int bins : {8, 16, 32})
+  {
+    double ms = time_ms([&]()
+                        { tree = mondrian::build_sah_tree<3>(M.indices(), M.x(), {bins}); },
+                        1);
+    std::cout << "  bins: " << std::setw(2) << bins
+              << "  sah: " << mondrian::sah_cost(tree.nodes, tree.extents)
+              << "  " << ms << " ms" << std::endl;
+  }
+}
+
+// builds over the primitive sets against the STRIDE path, points skip the index array
+// and double geometry pays for the outward rounding of its boxes
+void bench_primitive_sets(int N)
+{
+  mondrian::test_case M(N, 3);
+  std::vector<int> identity(M.x().size());
+  for (int i = 0; i < identity.size(); i++)
+    identity[i] = i;
+  mondrian::point_set<> points(M.x());
+  mondrian::triangle_set<> triangles(M.indices(), M.x());
+  std::vector<glm::dvec3> x_d(M.x().begin(), M.x().end());
+  mondrian::triangle_set<double> triangles_d(M.indices(), x_d);
+
+  double stride1_ms = time_ms([&]()
+                              { mondrian::build_aabb_tree<1>(identity, M.x()); });
+  double points_ms = time_ms([&]()
+                             { mondrian::build_aabb_tree(points); });
+  double stride3_ms = time_ms([&]()
+                              { mondrian::build_aabb_tree<3>(M.indices(), M.x()); });
+  double triangles_ms = time_ms([&]()
+                                { mondrian::build_aabb_tree(triangles); });
+  double triangles_d_ms = time_ms([&]()
+                                  { mondrian::build_aabb_tree(triangles_d); });
+
+  std::cout << "primitive sets, N = " << N << std::endl;
+  std::cout << "  points:    " << std::fixed << std::setprecision(3) << points_ms << " ms  (stride 1 " << stride1_ms << " ms)" << std::endl;
+  std::cout << "  triangles: " << triangles_ms << " ms  (stride 3 " << stride3_ms << " ms, double "
+            << triangles_d_ms << " ms)" << std::endl;
+
+  // a flat tet has no inside, a point above it is as far as from its faces
+  std::vector<int> flat_indices = {0, 1, 2, 3};
+  std::vector<vec3> flat_x = {vec3(0.0f), vec3(1.0f, 0.0f, 0.0f), vec3(0.0f, 1.0f, 0.0f), vec3(0.3f, 0.3f, 0.0f)};
+  mondrian::tet_set<> flat(flat_indices, flat_x);
+  mondrian::aabb_tree flat_tree = mondrian::build_aabb_tree(flat);
+  real flat_d = mondrian::closest_point(flat_tree, flat, vec3(0.2f, 0.2f, 5.0f)).distance();
+  std::cout << "  flat tet distance: " << flat_d << " (5.000)" << std::endl;
+
+  // the generic queries on the sets against triangle_tree on the same mesh, the sets
+  // are views so they see the shrunk vertices. the double set matches to float precision
+  shrink_triangles(M, 0.01f);
+  std::copy(M.x().begin(), M.x().end(), x_d.begin());
+  mondrian::triangle_tree T(M.indices(), M.x());
+  mondrian::aabb_tree tree = mondrian::build_aabb_tree(triangles);
+  mondrian::aabb_tree tree_d = mondrian::build_aabb_tree(triangles_d);
+  std::vector<vec3> o = M.get_random_points(300);
+  std::vector<vec3> d = M.get_random_points(o.size() + 1);
+  int mismatches = 0;
+  for (int i = 0; i < o.size(); i++)
+  {
+    real ref = T.closest_point(o[i]).distance();
+    real dist = mondrian::closest_point(tree, triangles, o[i]).distance();
+    real dist_d = mondrian::closest_point(tree_d, triangles_d, glm::dvec3(o[i])).distance();
+    mondrian::ray_t r(o[i], glm::normalize(d[i + 1]));
+    mondrian::ray_hit a = T.intersect_closest(r), b = mondrian::intersect_closest(tree, triangles, r);
+    if (std::abs(dist - ref) > 1e-5f * std::max(ref, 1.0f) || std::abs(dist_d - ref) > 1e-5f * std::max(ref, 1.0f) ||
+        a.hit() != b.hit() || (a.hit() && std::abs(a.t - b.t) > 1e-5f * std::max(a.t, 1.0f)))
+      mismatches++;
+  }
+  std::cout << "  queries against triangle_tree, mismatches: " << mismatches << " / " << o.size() << std::endl;
+}
+
+// rays against leaf boxes, binary flat tree vs the collapsed 8 wide tree
+void bench_bvh8(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  std::vector<int> hash = mondrian::calc_morton_codes(mondrian::get_cens(M));
+  std::vector<int> ids = mondrian::sort_by_code(hash);
+  std::vector<mondrian::radix_tree_node> nodes = mondrian::build_tree(ids, hash);
+  std::vector<mondrian::extents_3> extents(ids.size());
+  for (int i = 0; i < ids.size(); i++)
+    extents[i] = mondrian::calc_extents<3>(ids[i], M.indices(), M.x());
+  std::vector<mondrian::extents_3> ext = mondrian::build_pyramid_bottom_up<mondrian::extents_3>(
+      extents, nodes,
+      []()
+      { return mondrian::ext::init(); },
+      [](const mondrian::extents_3 &a, const mondrian::extents_3 &b)
+      { return mondrian::pyramid(a, b); });
+
+  std::vector<mondrian::flat_bvh_node> flat = mondrian::flatten_tree(nodes, ext);
+  std::vector<mondrian::bvh8_node> wide;
+  double collapse_ms = time_ms([&]()
+                               { wide = mondrian::collapse_bvh8(nodes, ext); },
+                               1);
+
+  std::vector<vec3> o = M.get_random_points(100000);
+  std::vector<vec3> d = M.get_random_points(o.size() + 1);
+  std::vector<mondrian::ray_t> rays(o.size());
+  for (int i = 0; i < rays.size(); i++)
+    rays[i] = mondrian::ray_t(o[i], glm::normalize(d[i + 1]));
+
+  long flat_hits = 0, wide_hits = 0;
+  double flat_ms = time_ms([&]()
+                           {
+    flat_hits = 0;
+    for (const mondrian::ray_t &r : rays)
+      mondrian::traverse_flat(
+          flat, [&](const vec3 &mn, const vec3 &mx)
+          {
+            real t;
+            return mondrian::ray_box(r, {mn, mx}, 0.0, mondrian::ray_tmax, t); },
+          [&](uint, uint count)
+          { flat_hits += count; }); },
+                           1);
+  double wide_ms = time_ms([&]()
+                           {
+    wide_hits = 0;
+    for (const mondrian::ray_t &r : rays)
+      mondrian::traverse_bvh8(wide, r, mondrian::ray_tmax, [&](uint, uint count, real &)
+                              {
+        wide_hits += count;
+        return false; }); },
+                           1);
+
+  std::cout << "bvh8, N = " << N << ", collapse " << std::fixed << std::setprecision(3) << collapse_ms << " ms" << std::endl;
+  std::cout << "  binary: " << std::setw(10) << real(rays.size()) / flat_ms * 1e-3 << " Mrays/s  leaf hits " << flat_hits
+            << "  " << flat.size() * sizeof(mondrian::flat_bvh_node) / 1024 << " KB" << std::endl;
+  std::cout << "  8 wide: " << std::setw(10) << real(rays.size()) / wide_ms * 1e-3 << " Mrays/s  leaf hits " << wide_hits
+            << "  " << wide.size() * sizeof(mondrian::bvh8_node) / 1024 << " KB" << std::endl;
+
+  // quantized boxes only grow, the extra leaf hits are the price of the smaller nodes
+  auto bench_compressed = [&](const std::string &name, const auto &compressed)
+  {
+    long hits = 0;
+    double ms = time_ms([&]()
+                        {
+      hits = 0;
+      for (const mondrian::ray_t &r : rays)
+        mondrian::traverse_bvh8(compressed, r, mondrian::ray_tmax, [&](uint, uint count, real &)
+                                {
+          hits += count;
+          return false; }); },
+                        1);
+    std::cout << "  " << name << std::setw(10) << real(rays.size()) / ms * 1e-3 << " Mrays/s  leaf hits " << hits
+              << "  " << compressed.size() * sizeof(compressed[0]) / 1024 << " KB" << std::endl;
+  };
+  bench_compressed("8 bit:  ", mondrian::compress_bvh8<uint8_t>(wide));
+  bench_compressed("16 bit: ", mondrian::compress_bvh8<uint16_t>(wide));
+}
+
+// closest and any hit queries against triangles, one ray at a time and batched
+void bench_ray_queries(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  mondrian::triangle_tree T(M.indices(), M.x());
+
+  std::vector<vec3> o = M.get_random_points(100000);
+  std::vector<vec3> d = M.get_random_points(o.size() + 1);
+  std::vector<mondrian::ray_t> rays(o.size());
+  for (int i = 0; i < rays.size(); i++)
+    rays[i] = mondrian::ray_t(o[i], glm::normalize(d[i + 1]));
+
+  int n_hits = 0;
+  double single_ms = time_ms([&]()
+                             {
+    n_hits = 0;
+    for (const mondrian::ray_t &r : rays)
+      n_hits += T.intersect_closest(r).hit(); },
+                             1);
+  double batch_ms = time_ms([&]()
+                            { T.intersect_closest(rays); },
+                            1);
+  double any_ms = time_ms([&]()
+                          { T.intersect_any(rays, 0.5f); },
+                          1);
+  double stream_ms = time_ms([&]()
+                             { T.intersect_closest_stream(rays); },
+                             1);
+  double any_stream_ms = time_ms([&]()
+                                 { T.intersect_any_stream(rays, 0.5f); },
+                                 1);
+
+  std::cout << "ray queries, N = " << N << ", " << n_hits << " / " << rays.size() << " rays hit" << std::endl;
+  std::cout << "  closest:         " << std::fixed << std::setprecision(3) << real(rays.size()) / single_ms * 1e-3 << " Mrays/s" << std::endl;
+  std::cout << "  closest batched: " << real(rays.size()) / batch_ms * 1e-3 << " Mrays/s" << std::endl;
+  std::cout << "  any batched:     " << real(rays.size()) / any_ms * 1e-3 << " Mrays/s" << std::endl;
+  std::cout << "  closest stream:  " << real(rays.size()) / stream_ms * 1e-3 << " Mrays/s" << std::endl;
+  std::cout << "  any stream:      " << real(rays.size()) / any_stream_ms * 1e-3 << " Mrays/s" << std::endl;
+
+  // the first rays against every triangle, a closest hit matches when it is at the
+  // same distance, a tie can pick either triangle. the stream is forced onto packets
+  const int n_check = 300;
+  T.stream_min_bytes = 0;
+  std::vector<mondrian::ray_hit> batch = T.intersect_closest(rays);
+  std::vector<mondrian::ray_hit> stream = T.intersect_closest_stream(rays);
+  std::vector<bool> any = T.intersect_any(rays, 0.5f);
+  std::vector<bool> any_stream = T.intersect_any_stream(rays, 0.5f);
+  int mismatches = 0;
+  for (int i = 0; i < n_check; i++)
+  {
+    mondrian::watertight_ray wr(rays[i]);
+    mondrian::ray_hit best;
+    for (int j = 0; j < M.indices().size() / 3; j++)
+    {
+      mondrian::ray_hit hit;
+      if (mondrian::intersect_triangle(wr, T.vertex(j, 0), T.vertex(j, 1), T.vertex(j, 2), best.t, hit))
+        best = hit, best.prim = j;
+    }
+    auto same = [&](const mondrian::ray_hit &h)
+    { return h.hit() == best.hit() && (!h.hit() || std::abs(h.t - best.t) <= 1e-5f * std::max(best.t, 1.0f)); };
+    bool any_bf = best.hit() && best.t < 0.5f;
+    if (!same(T.intersect_closest(rays[i])) || !same(batch[i]) || !same(stream[i]) ||
+        T.intersect_any(rays[i], 0.5f) != any_bf || any[i] != any_bf || any_stream[i] != any_bf)
+      mismatches++;
+  }
+  std::cout << "  brute force mismatches: " << mismatches << " / " << n_check << std::endl;
+}
+
+// closest points on a 64^3 grid, scattered points against the same points in scan
+// order where the previous answer seeds the bound
+void bench_closest_point(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  mondrian::triangle_tree T(M.indices(), M.x());
+
+  const int g = 64;
+  std::vector<vec3> grid;
+  for (int i = 0; i < g; i++)
+    for (int j = 0; j < g; j++)
+      for (int k = 0; k < g; k++)
+        grid.push_back(vec3(-1.0f) + 2.0f * vec3(i, j, k) / real(g - 1));
+  std::vector<vec3> scattered = M.get_random_points(grid.size());
+
+  double single_ms = time_ms([&]()
+                             {
+    for (const vec3 &p : scattered)
+      T.closest_point(p); },
+                             1);
+  double batch_ms = time_ms([&]()
+                            { T.closest_point(grid); },
+                            1);
+  double band_ms = time_ms([&]()
+                           { T.distance(grid, 0.05f); },
+                           1);
+
+  std::cout << "closest point, N = " << N << ", " << grid.size() << " points" << std::endl;
+  std::cout << "  scattered:    " << std::fixed << std::setprecision(3) << real(grid.size()) / single_ms * 1e-3 << " Mpoints/s" << std::endl;
+  std::cout << "  grid batched: " << real(grid.size()) / batch_ms * 1e-3 << " Mpoints/s" << std::endl;
+  std::cout << "  grid band:    " << real(grid.size()) / band_ms * 1e-3 << " Mpoints/s" << std::endl;
+
+  // every 1000th grid point and the first scattered ones against every triangle,
+  // a match is at the same distance, equally close triangles can swap
+  const int n_check = 300;
+  std::vector<mondrian::point_hit> batch = T.closest_point(grid);
+  std::vector<real> band = T.distance(grid, 0.05f);
+  auto brute_force = [&](const vec3 &p)
+  {
+    real d2 = std::numeric_limits<real>::max();
+    for (int j = 0; j < M.indices().size() / 3; j++)
+    {
+      real u, v, w;
+      vec3 q = mondrian::closest_point_triangle(p, T.vertex(j, 0), T.vertex(j, 1), T.vertex(j, 2), u, v, w);
+      d2 = std::min(d2, glm::dot(q - p, q - p));
+    }
+    return std::sqrt(d2);
+  };
+  auto same = [](real a, real b)
+  { return std::abs(a - b) <= 1e-5f * std::max(b, 1.0f); };
+  int mismatches = 0;
+  for (int i = 0; i < n_check; i++)
+  {
+    int k = 1000 * i % grid.size();
+    real d = brute_force(grid[k]);
+    if (!same(batch[k].distance(), d) || !same(band[k], std::min(d, 0.05f)))
+      mismatches++;
+    if (!same(T.closest_point(scattered[i]).distance(), brute_force(scattered[i])))
+      mismatches++;
+  }
+  std::cout << "  brute force mismatches: " << mismatches << " / " << 2 * n_check << std::endl;
+}
+
+// inside tests on a 64^3 grid against a closed unit sphere of about N triangles,
+// misclassified counts points off the surface by more than one cell
+void bench_winding_number(int N)
+{
+  int n = std::max(int(std::sqrt(N / 4.0)), 2);
+  std::vector<int> indices;
+  std::vector<vec3> x;
+  for (int i = 0; i <= n; i++)
+    for (int j = 0; j < 2 * n; j++)
+    {
+      real th = 3.14159265f * i / n, ph = 3.14159265f * j / n;
+      x.push_back(vec3(std::sin(th) * std::cos(ph), std::sin(th) * std::sin(ph), std::cos(th)));
+    }
+  auto id = [n](int i, int j)
+  { return i * 2 * n + j % (2 * n); };
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < 2 * n; j++)
+    {
+      indices.insert(indices.end(), {id(i, j), id(i + 1, j), id(i + 1, j + 1)});
+      indices.insert(indices.end(), {id(i, j), id(i + 1, j + 1), id(i, j + 1)});
+    }
+  mondrian::triangle_tree T(indices, x);
+
+  const int g = 64;
+  real cell = 3.0f / g;
+  std::vector<vec3> grid;
+  for (int i = 0; i < g; i++)
+    for (int j = 0; j < g; j++)
+      for (int k = 0; k < g; k++)
+        grid.push_back(vec3(-1.5f) + cell * (vec3(i, j, k) + vec3(0.5f)));
+
+  std::cout << "winding number, " << indices.size() / 3 << " triangles, " << grid.size() << " points" << std::endl;
+  for (real beta : {1.0f, 2.0f, 4.0f})
+  {
+    std::vector<bool> in;
+    double ms = time_ms([&]()
+                        { in = T.inside(grid, beta); },
+                        1);
+    int wrong = 0;
+    for (int i = 0; i < grid.size(); i++)
+    {
+      real r = glm::length(grid[i]);
+      if (std::abs(r - 1.0f) > cell && in[i] != (r < 1.0f))
+        wrong++;
+    }
+    std::cout << "  beta: " << std::fixed << std::setprecision(1) << beta
+              << "  " << std::setprecision(3) << std::setw(9) << ms << " ms"
+              << "  " << real(grid.size()) / ms * 1e-3 << " Mpoints/s"
+              << "  misclassified: " << wrong << std::endl;
+  }
+}
+
+// broadphase self collision on a tree
+void bench_overlap_pairs(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  mondrian::aabb_tree tree = mondrian::build_aabb_tree<3>(M.indices(), M.x());
+
+  std::vector<mondrian::prim_pair> pairs;
+  double ms = time_ms([&]()
+                      { pairs = mondrian::find_overlapping_pairs(tree, 0.001f); },
+                      1);
+  std::cout << "overlap pairs, N = " << N << std::endl;
+  std::cout << "  self: " << pairs.size() << " pairs in " << std::fixed << std::setprecision(3) << ms << " ms"
+            << "  " << real(N) / ms * 1e-3 << " Mprims/s" << std::endl;
+}
+
+// all points neighbor lists on the test_case random points, the radius is picked so
+// every point sees about 32 neighbors
+void bench_neighbors(int N)
+{
+  mondrian::test_case M(N, 1);
+  const std::vector<vec3> &x = M.x();
+  real r = std::cbrt(32.0f * 8.0f * 3.0f / (4.0f * 3.14159265f * N));
+
+  mondrian::aabb_tree tree;
+  double build_ms = time_ms([&]()
+                            { tree = mondrian::build_point_tree(x); },
+                            1);
+  mondrian::neighbor_lists radius, nearest;
+  double radius_ms = time_ms([&]()
+                             { radius = mondrian::radius_query_all(tree, x, r); },
+                             1);
+  double knn_ms = time_ms([&]()
+                          { nearest = mondrian::knn_all(tree, x, 16); },
+                          1);
+
+  std::cout << "neighbors, N = " << N << ", build " << std::fixed << std::setprecision(3) << build_ms << " ms" << std::endl;
+  std::cout << "  radius " << r << ": " << real(N) / radius_ms * 1e-3 << " Mpoints/s, "
+            << real(radius.neighbors.size()) / N << " neighbors per point" << std::endl;
+  std::cout << "  knn 16:       " << real(N) / knn_ms * 1e-3 << " Mpoints/s" << std::endl;
+}
+
+// deforming mesh, every frame swirls the vertices a bit further and compares refitting
+// the existing topology against a full rebuild, both in time and in SAH cost
+void bench_refit(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  const std::vector<vec3> x0 = M.x();
+
+  mondrian::aabb_tree tree = mondrian::build_aabb_tree<3>(M.indices(), M.x());
+  std::cout << "refit, N = " << N << std::endl;
+  for (int frame = 1; frame <= 8; frame++)
+  {
+    real a = 0.1f * frame;
+    for (int i = 0; i < x0.size(); i++)
+    {
+      const vec3 &p = x0[i];
+      real s = a * p[2];
+      M.x()[i] = vec3(cos(s) * p[0] - sin(s) * p[1], sin(s) * p[0] + cos(s) * p[1], p[2]);
+    }
+
+    double refit_ms = time_ms([&]()
+                              { mondrian::refit_aabb_tree<3>(tree, M.indices(), M.x()); },
+                              1);
+    mondrian::aabb_tree fresh;
+    double rebuild_ms = time_ms([&]()
+                                { fresh = mondrian::build_aabb_tree<3>(M.indices(), M.x()); },
+                                1);
+    real refit_sah = mondrian::sah_cost(tree.nodes, tree.extents);
+    real rebuild_sah = mondrian::sah_cost(fresh.nodes, fresh.extents);
+    std::cout << "  frame " << frame << "  refit " << std::fixed << std::setprecision(3) << refit_ms << " ms"
+              << "  rebuild " << rebuild_ms << " ms"
+              << "  sah ratio " << std::setprecision(2) << refit_sah / rebuild_sah << std::endl;
+  }
+}
+
+// grid against tree on the same uniform points and radius, about 32 neighbors each
+void bench_spatial_hash(int N)
+{
+  mondrian::test_case M(N, 1);
+  const std::vector<vec3> &x = M.x();
+  real r = std::cbrt(32.0f * 8.0f * 3.0f / (4.0f * 3.14159265f * N));
+
+  mondrian::aabb_tree tree;
+  double tree_build_ms = time_ms([&]()
+                                 { tree = mondrian::build_point_tree(x); },
+                                 1);
+  mondrian::neighbor_lists tree_lists;
+  double tree_query_ms = time_ms([&]()
+                                 { tree_lists = mondrian::radius_query_all(tree, x, r); },
+                                 1);
+
+  mondrian::spatial_hash::ptr grid;
+  double grid_build_ms = time_ms([&]()
+                                 { grid = mondrian::spatial_hash::create(x, r); },
+                                 1);
+  mondrian::neighbor_lists grid_lists;
+  double grid_query_ms = time_ms([&]()
+                                 { grid_lists = grid->radius_query_all(r); },
+                                 1);
+
+  std::cout << "spatial hash vs tree, N = " << N << ", radius " << std::fixed << std::setprecision(4) << r
+            << ", grid " << grid->resolution() << "^3" << std::endl;
+  std::cout << "  tree: build " << std::setprecision(3) << tree_build_ms << " ms, query "
+            << tree_query_ms << " ms" << std::endl;
+  std::cout << "  grid: build " << grid_build_ms << " ms, query " << grid_query_ms << " ms"
+            << "  speedup: " << std::setprecision(2) << (tree_build_ms + tree_query_ms) / (grid_build_ms + grid_query_ms)
+            << (grid_lists.offsets == tree_lists.offsets ? "" : "  (neighbor counts differ)") << std::endl;
+}
+
+// spawning and despawning, every frame 1% of the primitives are removed and as many new
+// ones inserted, against rebuilding the static tree from scratch
+void bench_dynamic_tree(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  std::vector<mondrian::extents_3> boxes(N);
+  for (int i = 0; i < N; i++)
+    boxes[i] = mondrian::calc_extents<3>(i, M.indices(), M.x());
+
+  mondrian::dynamic_tree tree(0.001f);
+  std::vector<uint> handles(N);
+  double insert_ms = time_ms([&]()
+                             {
+    tree.clear();
+    for (int i = 0; i < N; i++)
+      handles[i] = tree.insert(boxes[i], i); },
+                             1);
+
+  int churn = std::max(N / 100, 1);
+  std::mt19937 re(7);
+  double churn_ms = time_ms([&]()
+                            {
+    for (int j = 0; j < churn; j++)
+    {
+      int i = re() % N;
+      tree.remove(handles[i]);
+      handles[i] = tree.insert(boxes[i], i);
+    } });
+  double rebuild_ms = time_ms([&]()
+                              { mondrian::build_aabb_tree<3>(M.indices(), M.x()); },
+                              1);
+
+  std::cout << "dynamic tree, N = " << N << ", height " << tree.height()
+            << ", sah " << std::fixed << std::setprecision(2) << tree.sah_cost() << std::endl;
+  std::cout << "  insert all:      " << std::setprecision(3) << insert_ms << " ms" << std::endl;
+  std::cout << "  churn " << churn << ": " << churn_ms << " ms"
+            << "  (static rebuild " << rebuild_ms << " ms)" << std::endl;
+}
+
+// what the frame thread pays per rebuild, a build in place against handing a snapshot
+// to the background builder, and how long until the new tree is published
+void bench_async_tree(int N)
+{
+  mondrian::test_case M(N, 3);
+  mondrian::aabb_tree tree;
+  double sync_ms = time_ms([&]()
+                           { tree = mondrian::build_aabb_tree<3>(M.indices(), M.x()); });
+
+  mondrian::async_tree<3> async;
+  double submit_ms = 0.0, publish_ms = 0.0;
+  const int n_frames = 5;
+  for (int f = 0; f < n_frames; f++)
+  {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    async.rebuild(M.indices(), M.x());
+    mondrian::async_tree<3>::tree_ptr current = async.tree();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    async.wait();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    submit_ms += std::chrono::duration<double, std::milli>(t1 - t0).count() / n_frames;
+    publish_ms += std::chrono::duration<double, std::milli>(t2 - t0).count() / n_frames;
+  }
+
+  std::cout << "async tree, N = " << N << std::endl;
+  std::cout << "  build in place:  " << std::fixed << std::setprecision(3) << sync_ms << " ms" << std::endl;
+  std::cout << "  snapshot + swap: " << submit_ms << " ms  (published after " << publish_ms << " ms)" << std::endl;
+}
+
+// startup cost, building the tree against hashing the mesh and mapping a saved one
+void bench_tree_cache(int N)
+{
+  mondrian::test_case M(N, 3);
+  std::string path = "mondrian_bench_tree.bin";
+  std::remove(path.c_str());
+
+  mondrian::aabb_tree tree;
+  double build_ms = time_ms([&]()
+                            { tree = mondrian::build_aabb_tree<3>(M.indices(), M.x()); },
+                            1);
+  uint64_t hash = 0;
+  double hash_ms = time_ms([&]()
+                           { hash = mondrian::hash_geometry<3>(M.indices(), M.x()); },
+                           1);
+  double save_ms = time_ms([&]()
+                           { mondrian::save_tree(path, tree, hash); },
+                           1);
+  mondrian::mapped_tree::ptr mapped;
+  double open_ms = time_ms([&]()
+                           { mapped = mondrian::mapped_tree::open(path, hash); });
+
+  std::cout << "tree cache, N = " << N << std::endl;
+  std::cout << "  build " << std::fixed << std::setprecision(3) << build_ms << " ms, save " << save_ms << " ms" << std::endl;
+  std::cout << "  hash " << hash_ms << " ms + open " << open_ms << " ms"
+            << (mapped ? "" : " (failed)") << std::endl;
+  mapped = nullptr;
+  std::remove(path.c_str());
+}
+
+// 30 vs 63 bit morton keys, on uniform data and on a dense cluster inside a large
+// domain where most primitives land in the same 1024^3 cell
+void bench_key_width(int N)
+{
+  mondrian::test_case M(N, 3);
+  shrink_triangles(M, 0.01f);
+  std::cout << "key width, uniform, N = " << N << std::endl;
+  bench_key<int>("30 bit", M);
+  bench_key<uint64_t>("63 bit", M);
+
+  // spread the first 1% of triangles out so the rest ends up clustered
+  for (int i = 0; i < M.x().size() / 100; i++)
+    M.x()[i] *= 1000.0f;
+  std::cout << "key width, clustered, N = " << N << std::endl;
+  bench_key<int>("30 bit", M);
+  bench_key<uint64_t>("63 bit", M);
+}
+
+// tree gravity against the direct sum on a plummer like cluster, capped so the
+// O(N^2) reference finishes
+void bench_barnes_hut(int N)
+{
+  N = std::min(N, 1 << 15);
+  std::mt19937_64 re(7);
+  std::normal_distribution<real> G(0.0, 1.0);
+  mondrian::particles P;
+  for (int i = 0; i < N; i++)
+  {
+    vec3 d = glm::normalize(vec3(G(re), G(re), G(re)));
+    real r = std::abs(G(re)) / (1.0f + std::abs(G(re)));
+    P.add(r * d, 1.0f / N);
+  }
+
+  std::vector<vec3> direct;
+  double direct_ms = time_ms([&]()
+                             { direct = mondrian::direct_accelerations(P); },
+                             1);
+  mondrian::barnes_hut::ptr bh;
+  double build_ms = time_ms([&]()
+                            { bh = mondrian::barnes_hut::create(P); },
+                            1);
+
+  std::cout << "barnes hut, N = " << N << std::endl;
+  std::cout << "  direct:     " << std::fixed << std::setprecision(3) << direct_ms << " ms" << std::endl;
+  std::cout << "  build:      " << build_ms << " ms" << std::endl;
+  for (real theta : {0.3f, 0.5f, 0.8f})
+  {
+    std::vector<vec3> a;
+    double ms = time_ms([&]()
+                        { a = bh->accelerations(theta); },
+                        1);
+    double err = 0.0, norm = 0.0;
+    for (int i = 0; i < N; i++)
+    {
+      err += glm::dot(a[i] - direct[i], a[i] - direct[i]);
+      norm += glm::dot(direct[i], direct[i]);
+    }
+    std::cout << "  theta: " << std::setprecision(1) << theta
+              << "  " << std::setprecision(3) << std::setw(9) << ms << " ms"
+              << "  rms error: " << std::scientific << std::sqrt(err / norm) << std::fixed
+              << "  speedup: " << std::setprecision(2) << direct_ms / (build_ms + ms) << std::endl;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int N = argc > 1 ? std::stoi(argv[1]) : 1 << 20;
+  int max_threads = argc > 2 ? std::stoi(argv[2]) : std::thread::hardware_concurrency();
+  bench_morton_codes(N);
+  bench_sort(N);
+  bench_build_tree(N, std::max(max_threads, 1));
+  bench_pyramid(N);
+  bench_refit(N);
+  bench_key_width(N);
+  bench_treelets(N);
+  bench_ploc(N);
+  bench_binned_sah(N);
+  bench_primitive_sets(N);
+  bench_bvh8(N);
+  bench_ray_queries(N);
+  bench_closest_point(N);
+  bench_winding_number(N);
+  bench_overlap_pairs(N);
+  bench_neighbors(N);
+  bench_spatial_hash(N);
+  bench_tree_cache(N);
+  bench_dynamic_tree(N);
+  bench_async_tree(N);
+  bench_barnes_hut(N);
+  return 0;
+}
@@ -0,0 +1,155 @@
+#ifndef __MONDIAN_SUITE_DATASETS__
+#define __MONDIAN_SUITE_DATASETS__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+
+#include "tiny_obj_loader.h"
+#include "mondrian/aabb.hpp"
+
+// triangle soups for the suite, every dataset returns exactly N triangles
+// with their own three vertices, inside roughly [-1, 1]^3
+struct mesh
+{
+  std::vector<int> indices;
+  std::vector<vec3> x;
+
+  int size() const { return indices.size() / 3; }
+
+  void add(const vec3 &a, const vec3 &b, const vec3 &c)
+  {
+    for (const vec3 &v : {a, b, c})
+    {
+      indices.push_back(x.size());
+      x.push_back(v);
+    }
+  }
+};
+
+// equilateral-ish triangle of edge s around c with a random orientation
+inline void add_small_triangle(mesh &M, const vec3 &c, real s, std::mt19937_64 &re)
+{
+  std::normal_distribution<real> n(0.0, 1.0);
+  vec3 u = glm::normalize(vec3(n(re), n(re), n(re)));
+  vec3 v = glm::normalize(glm::cross(u, vec3(n(re), n(re), n(re))));
+  M.add(c + s * u, c + s * (-0.5f * u + 0.866f * v), c + s * (-0.5f * u - 0.866f * v));
+}
+
+// uniform density, triangles about as large as the spacing between them
+inline mesh uniform_mesh(int N)
+{
+  std::mt19937_64 re(1);
+  std::uniform_real_distribution<real> U(-1.0, 1.0);
+  real s = std::cbrt(8.0f / N);
+  mesh M;
+  for (int i = 0; i < N; i++)
+    add_small_triangle(M, vec3(U(re), U(re), U(re)), 0.5f * s, re);
+  return M;
+}
+
+// gaussian blobs of very different sizes, most primitives end up in a few dense
+// regions which is where 30 bit morton codes start to collide
+inline mesh clustered_mesh(int N)
+{
+  std::mt19937_64 re(2);
+  std::uniform_real_distribution<real> U(-1.0, 1.0);
+  std::normal_distribution<real> G(0.0, 1.0);
+  const int n_clusters = 32;
+  std::vector<vec3> centers(n_clusters);
+  std::vector<real> sigma(n_clusters);
+  for (int k = 0; k < n_clusters; k++)
+  {
+    centers[k] = vec3(U(re), U(re), U(re));
+    sigma[k] = std::pow(10.0f, -1.0f - 2.0f * std::abs(U(re))); // 1e-3 .. 1e-1
+  }
+  mesh M;
+  for (int i = 0; i < N; i++)
+  {
+    int k = re() % n_clusters;
+    vec3 c = centers[k] + sigma[k] * vec3(G(re), G(re), G(re));
+    add_small_triangle(M, c, 0.05f * sigma[k], re);
+  }
+  return M;
+}
+
+// long thin triangles, 1000:1, the case where centroid based builders struggle
+// because boxes overlap far beyond their centroids
+inline mesh skinny_mesh(int N)
+{
+  std::mt19937_64 re(3);
+  std::uniform_real_distribution<real> U(-1.0, 1.0);
+  std::normal_distribution<real> G(0.0, 1.0);
+  real len = 4.0f * std::cbrt(8.0f / N);
+  mesh M;
+  for (int i = 0; i < N; i++)
+  {
+    vec3 c(U(re), U(re), U(re));
+    vec3 u = glm::normalize(vec3(G(re), G(re), G(re)));
+    vec3 v = glm::normalize(glm::cross(u, vec3(G(re), G(re), G(re))));
+    M.add(c - 0.5f * len * u, c + 0.5f * len * u, c + 0.001f * len * v);
+  }
+  return M;
+}
+
+inline bool load_obj(const std::string &path, mesh &M)
+{
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.c_str()))
+  {
+    std::cerr << err << std::endl;
+    return false;
+  }
+  for (const auto &shape : shapes)
+    for (size_t i = 0; i + 2 < shape.mesh.indices.size(); i += 3)
+    {
+      vec3 v[3];
+      for (int k = 0; k < 3; k++)
+      {
+        int vi = shape.mesh.indices[i + k].vertex_index;
+        v[k] = vec3(attrib.vertices[3 * vi + 0], attrib.vertices[3 * vi + 1], attrib.vertices[3 * vi + 2]);
+      }
+      M.add(v[0], v[1], v[2]);
+    }
+  return M.size() > 0;
+}
+
+// copies of the bunny on a jittered grid, randomly turned and scaled, until there are
+// N triangles. keeps the real surface distribution (dense, thin, open) at any size
+inline mesh bunny_mesh(int N, const mesh &bunny)
+{
+  std::mt19937_64 re(4);
+  std::uniform_real_distribution<real> U(-1.0, 1.0);
+  mondrian::ext::extents_t e = mondrian::ext::init();
+  for (const vec3 &v : bunny.x)
+    e = mondrian::ext::expand(e, v);
+  vec3 c = 0.5f * (e[0] + e[1]);
+  vec3 d = e[1] - e[0];
+  real size = std::max(std::max(d[0], d[1]), d[2]);
+
+  int n_copies = (N + bunny.size() - 1) / bunny.size();
+  int k = int(std::ceil(std::cbrt(real(n_copies))));
+  real cell = 2.0f / k;
+  mesh M;
+  for (int i = 0; M.size() < N; i++)
+  {
+    vec3 p = vec3(i % k, (i / k) % k, i / (k * k)) * cell - vec3(1.0f) + vec3(0.5f * cell);
+    p += 0.1f * cell * vec3(U(re), U(re), U(re));
+    real s = cell / size * (0.7f + 0.2f * U(re));
+    glm::mat3 R = glm::mat3(glm::rotate(glm::mat4(1.0f), 3.14159265f * U(re), glm::normalize(vec3(U(re), 1.0f, U(re)))));
+    for (int t = 0; t < bunny.size() && M.size() < N; t++)
+    {
+      vec3 v[3];
+      for (int j = 0; j < 3; j++)
+        v[j] = p + s * (R * (bunny.x[bunny.indices[3 * t + j]] - c));
+      M.add(v[0], v[1], v[2]);
+    }
+  }
+  return M;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <map>
+
+#include "mondrian/aabb.hpp"
+#include "mondrian/wide_bvh.hpp"
+#include "mondrian/ploc.hpp"
+#include "mondrian/binned_sah.hpp"
+#include "mondrian/triangle_tree.hpp"
+
+#include "datasets.hpp"
+
+// end to end numbers on realistic inputs, for tracking regressions across commits.
+// mondrian_bench has the micro benchmarks of single kernels
+//
+//   mondrian_suite [--sizes 10000,100000,...] [--datasets uniform,clustered,bunny,skinny]
+//                  [--rays 100000] [--bunny path/to/bunny.obj] [--json out.json]
+
+template <typename F>
+double time_ms(F &&f, int n_runs = 1)
+{
+  double best = std::numeric_limits<double>::max();
+  for (int i = 0; i < n_runs; i++)
+  {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    f();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double, std::milli>(t1 - t0).count());
+  }
+  return best;
+}
+
+// one row of the report, kept as ordered name / value pairs so the console and the
+// json writer print the same thing
+struct result
+{
+  std::string dataset;
+  int primitives = 0;
+  std::vector<std::pair<std::string, double>> values;
+
+  void set(const std::string &name, double v) { values.push_back({name, v}); }
+};
+
+template <typename T>
+size_t bytes(const std::vector<T> &v) { return v.size() * sizeof(T); }
+
+result run(const std::string &dataset, mesh M, int n_rays)
+{
+  result res;
+  res.dataset = dataset;
+  res.primitives = M.size();
+  int N = M.size();
+  // small inputs are noisy, take the best of a few runs
+  int n_runs = N <= 100000 ? 5 : 1;
+
+  mondrian::aabb_tree tree;
+  double build_ms = time_ms([&]()
+                            { tree = mondrian::build_aabb_tree<3>(M.indices, M.x); },
+                            n_runs);
+  res.set("build_ms", build_ms);
+  res.set("build_mprims_per_s", N / build_ms * 1e-3);
+
+  std::array<real, 2> depth = mondrian::tree_depth(tree.nodes);
+  res.set("sah", mondrian::sah_cost(tree.nodes, tree.extents));
+  res.set("max_depth", depth[0]);
+  res.set("mean_leaf_depth", depth[1]);
+  res.set("tree_bytes", bytes(tree.nodes) + bytes(tree.extents) + bytes(tree.ids));
+
+  mondrian::aabb_tree ploc;
+  double ploc_ms = time_ms([&]()
+                           { ploc = mondrian::build_ploc_tree<3>(M.indices, M.x); },
+                           n_runs);
+  res.set("ploc_build_ms", ploc_ms);
+  res.set("ploc_sah", mondrian::sah_cost(ploc.nodes, ploc.extents));
+  ploc = mondrian::aabb_tree();
+
+  mondrian::aabb_tree sah;
+  double sah_ms = time_ms([&]()
+                          { sah = mondrian::build_sah_tree<3>(M.indices, M.x); },
+                          n_runs);
+  res.set("sah_build_ms", sah_ms);
+  res.set("sah_sah", mondrian::sah_cost(sah.nodes, sah.extents));
+  sah = mondrian::aabb_tree();
+
+  std::vector<mondrian::bvh8_node> wide;
+  double collapse_ms = time_ms([&]()
+                               { wide = mondrian::collapse_bvh8(tree.nodes, tree.extents); },
+                               n_runs);
+  res.set("bvh8_collapse_ms", collapse_ms);
+  res.set("bvh8_bytes", bytes(wide));
+  wide.clear();
+  wide.shrink_to_fit();
+
+  // small deformation, every vertex moves by about a hundredth of the domain
+  std::mt19937_64 re(5);
+  std::uniform_real_distribution<real> U(-1.0, 1.0);
+  for (vec3 &v : M.x)
+    v += 0.01f * vec3(U(re), U(re), U(re));
+  double refit_ms = time_ms([&]()
+                            { mondrian::refit_aabb_tree<3>(tree, M.indices, M.x); },
+                            n_runs);
+  res.set("refit_ms", refit_ms);
+  res.set("refit_mprims_per_s", N / refit_ms * 1e-3);
+  res.set("refit_sah", mondrian::sah_cost(tree.nodes, tree.extents));
+  tree = mondrian::aabb_tree();
+
+  // incoherent rays from inside the bounds in random directions
+  std::vector<mondrian::ray_t> rays(n_rays);
+  for (mondrian::ray_t &r : rays)
+    r = mondrian::ray_t(vec3(U(re), U(re), U(re)), glm::normalize(vec3(U(re), U(re), U(re))));
+
+  mondrian::triangle_tree T(std::move(M.indices), std::move(M.x));
+  std::vector<mondrian::ray_hit> hits;
+  double ray_ms = time_ms([&]()
+                          { hits = T.intersect_closest(rays); });
+  double stream_ms = time_ms([&]()
+                             { T.intersect_closest_stream(rays); });
+  int n_hits = 0;
+  for (const mondrian::ray_hit &h : hits)
+    n_hits += h.hit();
+  res.set("ray_mrays_per_s", n_rays / ray_ms * 1e-3);
+  res.set("ray_stream_mrays_per_s", n_rays / stream_ms * 1e-3);
+  res.set("ray_hit_fraction", real(n_hits) / std::max(n_rays, 1));
+  return res;
+}
+
+void print(const result &res)
+{
+  std::cout << std::left << std::setw(10) << res.dataset << std::right << std::setw(10) << res.primitives;
+  for (const auto &[name, v] : res.values)
+    std::cout << "  " << name << " " << std::setprecision(4) << v;
+  std::cout << std::endl;
+}
+
+void write_json(const std::string &path, const std::vector<result> &results, int n_rays)
+{
+  std::ofstream out(path);
+  out << "{\n";
+  out << "  \"threads\": " << mondrian::get_num_threads() << ",\n";
+  out << "  \"rays\": " << n_rays << ",\n";
+  out << "  \"results\": [\n";
+  for (int i = 0; i < results.size(); i++)
+  {
+    const result &res = results[i];
+    out << "    {\"dataset\": \"" << res.dataset << "\", \"primitives\": " << res.primitives;
+    for (const auto &[name, v] : res.values)
+      out << ", \"" << name << "\": " << std::setprecision(9) << v;
+    out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+std::vector<std::string> split(const std::string &s)
+{
+  std::vector<std::string> out;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    out.push_back(item);
+  return out;
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<int> sizes = {10000, 100000, 1000000, 10000000};
+  std::vector<std::string> datasets = {"uniform", "clustered", "bunny", "skinny"};
+  std::string bunny_path = RESOURCE_DIR "/bunny.obj";
+  std::string json_path;
+  int n_rays = 100000;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    std::string arg = argv[i], value = argv[i + 1];
+    if (arg == "--sizes")
+    {
+      sizes.clear();
+      for (const std::string &s : split(value))
+        sizes.push_back(std::stoi(s));
+    }
+    else if (arg == "--datasets")
+      datasets = split(value);
+    else if (arg == "--rays")
+      n_rays = std::stoi(value);
+    else if (arg == "--bunny")
+      bunny_path = value;
+    else if (arg == "--json")
+      json_path = value;
+    else
+    {
+      std::cerr << "unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  mesh bunny;
+  bool have_bunny = load_obj(bunny_path, bunny);
+
+  std::vector<result> results;
+  for (const std::string &dataset : datasets)
+    for (int N : sizes)
+    {
+      mesh M;
+      if (dataset == "uniform")
+        M = uniform_mesh(N);
+      else if (dataset == "clustered")
+        M = clustered_mesh(N);
+      else if (dataset == "skinny")
+        M = skinny_mesh(N);
+      else if (dataset == "bunny" && have_bunny)
+        M = bunny_mesh(N, bunny);
+      else
+      {
+        std::cerr << "skipping " << dataset << std::endl;
+        break;
+      }
+      results.push_back(run(dataset, std::move(M), n_rays));
+      print(results.back());
+    }
+
+  if (!json_path.empty())
+    write_json(json_path, results, n_rays);
+  return 0;
+}